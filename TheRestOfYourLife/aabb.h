@@ -13,6 +13,35 @@ class aabb
 		vec3 min() const { return _min; }
 		vec3 max() const { return _max; }
 
+		vec3 centroid() const { return 0.5 * (_min + _max); }
+
+		// Enlarge the box in place so it also encloses b (same as surrounding_box, but without temporaries)
+		void expand(const aabb& b)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				_min.e[a] = b._min.e[a] < _min.e[a] ? b._min.e[a] : _min.e[a];
+				_max.e[a] = b._max.e[a] > _max.e[a] ? b._max.e[a] : _max.e[a];
+			}
+		}
+
+		void expand(const vec3& p)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				_min.e[a] = p.e[a] < _min.e[a] ? p.e[a] : _min.e[a];
+				_max.e[a] = p.e[a] > _max.e[a] ? p.e[a] : _max.e[a];
+			}
+		}
+
+		// Surface area of the box. The surface area heuristic (SAH) uses it as the probability
+		// that a random ray hitting the parent box also hits this box.
+		double surface_area() const
+		{
+			vec3 d = _max - _min;
+			return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+		}
+
 		// tmin and tmax are the min / max allowed values of rays from the ray equation
 		// Implementation of ray-slab intersection
 		bool hit(const ray& r, double tmin, double tmax) const
@@ -1,167 +1,34 @@
 #pragma once
 
 #include "rtweekend.h"
-#include "hittable.h"
+#include "quad.h"
 
 
-class xy_rect : public hittable
+// Axis aligned rectangles are quads with their normal along an axis, which quad tests with a single
+// coordinate of the ray. Normals and uv are the same as before: +z with uv from x, y for xy_rect, +y
+// with uv from x, z for xz_rect and +x with uv from y, z for yz_rect.
+class xy_rect : public quad
 {
 	public:
-		xy_rect() {}
-
-		xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat)
-			: x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mat_ptr(mat)
+		xy_rect(double x0, double x1, double y0, double y1, double k, shared_ptr<material> mat)
+			: quad(vec3(x0, y0, k), vec3(x1 - x0, 0, 0), vec3(0, y1 - y0, 0), vec3(0, 0, 1), mat)
 		{}
-
-		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-
-		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
-		{
-			output_box = aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));
-			return true;
-		}
-
-	
-	private:
-		shared_ptr<material> mat_ptr;
-		double x0;
-		double x1;
-		double y0;
-		double y1;
-		double k;
 };
 
 
-class xz_rect : public hittable
+class xz_rect : public quad
 {
-public:
-	xz_rect() {}
-
-	xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat)
-		: x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat)
-	{}
-
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const
-	{
-		output_box = aabb(vec3(x0, k - 0.0001, z0), vec3(x1, k + 0.0001, z1));
-		return true;
-	}
-
-
-private:
-	shared_ptr<material> mat_ptr;
-	double x0;
-	double x1;
-	double z0;
-	double z1;
-	double k;
+	public:
+		xz_rect(double x0, double x1, double z0, double z1, double k, shared_ptr<material> mat)
+			: quad(vec3(x0, k, z0), vec3(x1 - x0, 0, 0), vec3(0, 0, z1 - z0), vec3(0, 1, 0), mat)
+		{}
 };
 
 
-class yz_rect : public hittable
+class yz_rect : public quad
 {
-public:
-	yz_rect() {}
-
-	yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat)
-		: y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat)
-	{}
-
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-
-	virtual bool bounding_box(double time0, double time1, aabb& output_box) const
-	{
-		output_box = aabb(vec3(k - 0.0001, y0, z0), vec3(k + 0.0001, y1, z1));
-		return true;
-	}
-
-
-private:
-	shared_ptr<material> mat_ptr;
-	double y0;
-	double y1;
-	double z0;
-	double z1;
-	double k;
+	public:
+		yz_rect(double y0, double y1, double z0, double z1, double k, shared_ptr<material> mat)
+			: quad(vec3(k, y0, z0), vec3(0, y1 - y0, 0), vec3(0, 0, z1 - z0), vec3(1, 0, 0), mat)
+		{}
 };
-
-
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-	// Determine ray / rectangle hitpoint z(t) = a_z + t * b_z with z = k => t = (k - a) / b
-	auto t = (k - r.origin().z()) / r.direction().z();
-	
-	// Is t inside rect?
-	if (t < t_min || t > t_max)
-		return false;
-
-	// Solve for x / y by plugging in t in equations x resp. y = a + t * b
-	auto x = r.origin().x() + t * r.direction().x();
-	auto y = r.origin().y() + t * r.direction().y();
-	
-	if (x < x0 || x > x1 || y < y0 || y > y1)
-		return false;
-
-	rec.u = (x - x0) / (x1 - x0);
-	rec.v = (y - y0) / (y1 - y0);
-	rec.t = t;
-	vec3 outward_normal = vec3(0, 0, 1);
-	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
-	rec.p = r.at(t);
-	return true;
-}
-
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-	// Determine ray / rectangle hitpoint z(t) = a_z + t * b_z with z = k => t = (k - a) / b
-	auto t = (k - r.origin().y()) / r.direction().y();
-
-	// Is t inside rect?
-	if (t < t_min || t > t_max)
-		return false;
-
-	// Solve for x / y by plugging in t in equations x resp. y = a + t * b
-	auto x = r.origin().x() + t * r.direction().x();
-	auto z = r.origin().z() + t * r.direction().z();
-
-	if (x < x0 || x > x1 || z < z0 || z > z1)
-		return false;
-
-	rec.u = (x - x0) / (x1 - x0);
-	rec.v = (z - z0) / (z1 - z0);
-	rec.t = t;
-	vec3 outward_normal = vec3(0, 1, 0);
-	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
-	rec.p = r.at(t);
-	return true;
-}
-
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-	// Determine ray / rectangle hitpoint z(t) = a_z + t * b_z with z = k => t = (k - a) / b
-	auto t = (k - r.origin().x()) / r.direction().x();
-
-	// Is t inside rect?
-	if (t < t_min || t > t_max)
-		return false;
-
-	// Solve for x / y by plugging in t in equations x resp. y = a + t * b
-	auto y = r.origin().y() + t * r.direction().y();
-	auto z = r.origin().z() + t * r.direction().z();
-
-	if (y < y0 || y > y1 || z < z0 || z > z1)
-		return false;
-
-	rec.u = (y - y0) / (y1 - y0);
-	rec.v = (z - z0) / (z1 - z0);
-	rec.t = t;
-	vec3 outward_normal = vec3(1, 0, 0);
-	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
-	rec.p = r.at(t);
-	return true;
-}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "camera.h"
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <vector>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+
+// Result of tracing a fixed set of rays against an acceleration structure
+struct hit_benchmark_result
+{
+	double seconds;
+	double mrays_per_second;
+	size_t hits;
+	long long cache_misses;		// last level cache misses of the fastest run, -1 if they could not be counted
+};
+
+
+/* Counts the last level cache misses of the calling thread with a hardware performance counter.
+   Only available on Linux (perf_event_open), and only if the kernel allows it (perf_event_paranoid);
+   otherwise valid() is false and the benchmarks print no miss counts. */
+class cache_miss_counter
+{
+	public:
+		cache_miss_counter();
+		~cache_miss_counter();
+
+		cache_miss_counter(const cache_miss_counter&) = delete;
+		cache_miss_counter& operator=(const cache_miss_counter&) = delete;
+
+		bool valid() const { return fd >= 0; }
+
+		void start();
+		// Misses since start()
+		long long stop();
+
+	private:
+		int fd = -1;
+};
+
+#ifdef __linux__
+cache_miss_counter::cache_miss_counter()
+{
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+cache_miss_counter::~cache_miss_counter()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+void cache_miss_counter::start()
+{
+	if (!valid())
+		return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+long long cache_miss_counter::stop()
+{
+	if (!valid())
+		return -1;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	long long count = 0;
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+#else
+cache_miss_counter::cache_miss_counter() {}
+cache_miss_counter::~cache_miss_counter() {}
+void cache_miss_counter::start() {}
+long long cache_miss_counter::stop() { return -1; }
+#endif
+
+// Wall clock time of f in seconds
+inline double time_seconds(const std::function<void()>& f)
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+	return diff.count();
+}
+
+// One jittered camera ray per pixel. Generated up front so every structure sees the same rays.
+std::vector<ray> make_camera_rays(camera& cam, int width, int height)
+{
+	std::vector<ray> rays;
+	rays.reserve(static_cast<size_t>(width) * height);
+	for (int j = 0; j < height; ++j)
+	{
+		for (int i = 0; i < width; ++i)
+		{
+			auto u = (i + random_double()) / width;
+			auto v = (j + random_double()) / height;
+			rays.push_back(cam.get_ray(u, v));
+		}
+	}
+	return rays;
+}
+
+// Closest hit throughput. The rays are traced repeat times, the fastest run counts.
+hit_benchmark_result benchmark_hits(const hittable& world, const std::vector<ray>& rays, int repeat = 3)
+{
+	hit_benchmark_result result = { infinity, 0, 0, -1 };
+	cache_miss_counter misses;
+	for (int n = 0; n < repeat; ++n)
+	{
+		size_t hits = 0;
+		misses.start();
+		double seconds = time_seconds([&]()
+		{
+			hit_record rec;
+			for (const auto& r : rays)
+				if (world.hit(r, epsilon, infinity, rec))
+					++hits;
+		});
+		long long cache_misses = misses.stop();
+
+		if (seconds < result.seconds)
+		{
+			result.seconds = seconds;
+			result.hits = hits;
+			result.cache_misses = cache_misses;
+		}
+	}
+	result.mrays_per_second = rays.size() / result.seconds * 1e-6;
+	return result;
+}
+
+// Any hit throughput of the same rays, as for shadow rays. hits counts the occluded rays.
+hit_benchmark_result benchmark_occlusion(const hittable& world, const std::vector<ray>& rays, int repeat = 3)
+{
+	hit_benchmark_result result = { infinity, 0, 0, -1 };
+	cache_miss_counter misses;
+	for (int n = 0; n < repeat; ++n)
+	{
+		size_t hits = 0;
+		misses.start();
+		double seconds = time_seconds([&]()
+		{
+			for (const auto& r : rays)
+				if (world.occluded(r, epsilon, infinity))
+					++hits;
+		});
+		long long cache_misses = misses.stop();
+
+		if (seconds < result.seconds)
+		{
+			result.seconds = seconds;
+			result.hits = hits;
+			result.cache_misses = cache_misses;
+		}
+	}
+	result.mrays_per_second = rays.size() / result.seconds * 1e-6;
+	return result;
+}
+
+void print_benchmark_row(const char* scene, const char* structure, double build_seconds, const hit_benchmark_result& result)
+{
+	std::cout	<< std::left << std::setw(16) << scene << std::setw(14) << structure
+				<< std::right << std::fixed << std::setprecision(4)
+				<< " build " << std::setw(9) << build_seconds << " s"
+				<< "  trace " << std::setw(9) << result.seconds << " s"
+				<< "  " << std::setprecision(2) << std::setw(8) << result.mrays_per_second << " Mrays/s"
+				<< "  hits " << result.hits;
+	if (result.cache_misses >= 0)
+		std::cout << "  LLC misses " << result.cache_misses;
+	std::cout << '\n';
+}
+
+// Memory of an acceleration structure per primitive it holds
+void print_memory_row(const char* scene, const char* structure, size_t bytes, size_t primitive_count)
+{
+	std::cout	<< std::left << std::setw(16) << scene << std::setw(14) << structure
+				<< std::right << std::fixed << std::setprecision(2)
+				<< " memory " << std::setw(10) << bytes / (1024.0 * 1024.0) << " MB"
+				<< "  " << std::setw(8) << static_cast<double>(bytes) / primitive_count << " bytes/primitive\n";
+}
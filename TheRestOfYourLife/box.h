@@ -2,15 +2,26 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
-#include "hittable_list.h"
-#include "aarect.h"
 
+/* Axis aligned box as one primitive: a single slab test gives the distances where the ray enters and
+   leaves the box and the faces it crosses there. Faces, normals and uv are the same as those of the
+   six rects (the ones at box_min wrapped in flip_face) the box used to be made of. */
 class box : public hittable
 {
 	public:
-		box(const vec3& p0, const vec3& p1, shared_ptr<material> mat);
+		box(const vec3& p0, const vec3& p1, shared_ptr<material> mat)
+			: box_min(p0), box_max(p1), mat_ptr(mat)
+		{}
 
-		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const;
+		virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const;
 
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
 		{
@@ -18,28 +29,125 @@ class box : public hittable
 			return true;
 		}
 
+	private:
+		// Faces are numbered 2 * axis + side, side 0 at box_min, 1 at box_max
+		bool slab(const ray& r, double& t_enter, int& enter_face, double& t_exit, int& exit_face) const;
+
 	private:
 		vec3 box_min;
 		vec3 box_max;
-		hittable_list sides;
+		shared_ptr<material> mat_ptr;
 };
 
-box::box(const vec3& p0, const vec3& p1, shared_ptr<material> mat)
+// A ray parallel to a pair of faces never hits them, like the rects (t would be infinite), and only
+// passes the box if it lies between them.
+bool box::slab(const ray& r, double& t_enter, int& enter_face, double& t_exit, int& exit_face) const
 {
-	box_min = p0;
-	box_max = p1;
+	t_enter = -infinity;
+	t_exit = infinity;
+	enter_face = -1;
+	exit_face = -1;
+
+	for (int a = 0; a < 3; ++a)
+	{
+		const double o = r.origin()[a];
+		const double d = r.direction()[a];
+		if (d == 0)
+		{
+			if (o < box_min[a] || o > box_max[a])
+				return false;
+			continue;
+		}
 
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), mat));
-	sides.add(make_shared<flip_face>(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat)));
+		double t0 = (box_min[a] - o) / d;
+		double t1 = (box_max[a] - o) / d;
+		int near_face = 2 * a;
+		int far_face = 2 * a + 1;
+		if (d < 0)
+		{
+			std::swap(t0, t1);
+			std::swap(near_face, far_face);
+		}
+
+		if (t0 > t_enter)
+		{
+			t_enter = t0;
+			enter_face = near_face;
+		}
+		if (t1 < t_exit)
+		{
+			t_exit = t1;
+			exit_face = far_face;
+		}
+	}
 
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), mat));
-	sides.add(make_shared<flip_face>(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), mat)));
+	return t_enter <= t_exit;
+}
+
+// The entry face if it lies in [t_min, t_max], else the exit face (rays starting inside the box)
+bool box::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	double t_enter;
+	double t_exit;
+	int enter_face;
+	int exit_face;
+	if (!slab(r, t_enter, enter_face, t_exit, exit_face))
+		return false;
+
+	if (t_enter >= t_min && t_enter <= t_max)
+	{
+		candidate.t = t_enter;
+		candidate.index = enter_face;
+	}
+	else if (t_exit >= t_min && t_exit <= t_max)
+	{
+		candidate.t = t_exit;
+		candidate.index = exit_face;
+	}
+	else
+	{
+		return false;
+	}
+
+	candidate.object = this;
+	return true;
+}
+
+void box::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+	const int axis = candidate.index / 2;
+	const bool max_side = candidate.index % 2 == 1;
+
+	rec.t = candidate.t;
+	rec.p = r.at(candidate.t);
+
+	// Same uv as the rects: xy for z faces, xz for y faces, yz for x faces
+	const int u_axis = axis == 0 ? 1 : 0;
+	const int v_axis = axis == 2 ? 1 : 2;
+	rec.u = (rec.p[u_axis] - box_min[u_axis]) / (box_max[u_axis] - box_min[u_axis]);
+	rec.v = (rec.p[v_axis] - box_min[v_axis]) / (box_max[v_axis] - box_min[v_axis]);
+
+	vec3 outward_normal(0, 0, 0);
+	outward_normal.e[axis] = max_side ? 1 : -1;
+	rec.set_face_normal(r, outward_normal);
+	rec.mat_ptr = mat_ptr;
+}
+
+bool box::occluded(const ray& r, double t_min, double t_max) const
+{
+	double t_enter;
+	double t_exit;
+	int enter_face;
+	int exit_face;
+	if (!slab(r, t_enter, enter_face, t_exit, exit_face))
+		return false;
 
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), mat));
-	sides.add(make_shared<flip_face>(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), mat)));
+	return (t_enter >= t_min && t_enter <= t_max) || (t_exit >= t_min && t_exit <= t_max);
 }
 
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool box::hit_interval(const ray& r, double& t_enter, double& t_exit) const
 {
-	return sides.hit(r, t_min, t_max, rec);
+	int enter_face;
+	int exit_face;
+	return slab(r, t_enter, enter_face, t_exit, exit_face);
 }
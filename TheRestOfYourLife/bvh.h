@@ -3,9 +3,13 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "bvh_builder.h"
 
 #include <algorithm>
 
+// Levels of the tree whose bvh_nodes are created as parallel tasks
+const int bvh_parallel_materialize_depth = 6;
+
 class bvh_node : public hittable
 {
 	public:
@@ -19,98 +23,240 @@ class bvh_node : public hittable
 			std::vector<shared_ptr<hittable>>& objects,
 			size_t start, size_t end, double time0, double time1);
 
-		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+		bvh_node(shared_ptr<hittable> l, shared_ptr<hittable> r, const aabb& b)
+			: left(l), right(r), box(b)
+		{}
+
+		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, tmin, tmax, rec);
+		}
+
+		virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
+		virtual bool occluded(const ray& r, double tmin, double tmax) const;
+
+		// Recomputes all boxes bottom-up after objects moved. The topology stays the same.
+		virtual void refit(double time0, double time1);
+
+		// Refit, then rebuild every subtree whose SAH cost grew beyond rebuild_threshold times its cost
+		// at build time (e.g. 1.5). Returns the number of rebuilt subtrees.
+		size_t refit(double time0, double time1, double rebuild_threshold);
+
+		// SAH cost of the subtree, computed from the child boxes and child costs
+		void update_sah_cost(const aabb& box_left, const aabb& box_right);
+
+		// Bytes of all nodes and leaf lists of the subtree, without the primitives themselves
+		size_t memory_bytes() const;
+
+	private:
+		size_t rebuild_degraded(double time0, double time1, double rebuild_threshold);
+		void collect_objects(std::vector<shared_ptr<hittable>>& objects) const;
 
 	public:
 		// Children of node are generic hittable: Can be other nodes or leaves (spheres, etc...)
+		// Leaves holding several objects have a hittable_list as left child and no right child.
 		shared_ptr<hittable> left;
 		shared_ptr<hittable> right;
 		aabb box;
+
+		double sah_cost = 0;		// current cost, updated by refit
+		double build_sah_cost = 0;	// cost right after the subtree was built
 };
 
-// Returns true if min value of a's boxes is less than min value of b's boxes for given axis
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis)
-{
-	aabb box_a;
-	aabb box_b;
+shared_ptr<hittable> make_bvh_leaf(const bvh_build_result& result, const bvh_build_node& node, const std::vector<shared_ptr<hittable>>& objects);
+shared_ptr<hittable> make_bvh_subtree(const bvh_build_result& result, uint32_t index, const std::vector<shared_ptr<hittable>>& objects, int depth);
 
-	if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-		std::cerr << "No bounding box in bvh_node constructor.\n";
+// Constructs BVH: start and end arguments select the objects the tree is built for.
+// Bounds are gathered once into flat arrays and the tree is built by the parallel binned SAH
+// builder (see bvh_builder.h), then turned into bvh_nodes.
+bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1)
+{
+	bvh_build_result result = build_bvh(make_bvh_primitives(objects, start, end, time0, time1));
+	const bvh_build_node& root = result.nodes[0];
 
-	return box_a.min().e[axis] < box_b.min().e[axis];
+	box = root.box;
+	if (root.count > 0)
+	{
+		// Whole list fits into a single leaf: no second child needed
+		left = make_bvh_leaf(result, root, objects);
+		right = nullptr;
+		update_sah_cost(box, box);
+	}
+	else
+	{
+		left = make_bvh_subtree(result, root.first, objects, 1);
+		right = make_bvh_subtree(result, root.second, objects, 1);
+		update_sah_cost(result.nodes[root.first].box, result.nodes[root.second].box);
+	}
+	build_sah_cost = sah_cost;
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+// Leaves holding one object store it directly, larger leaves collect their objects in a hittable_list
+shared_ptr<hittable> make_bvh_leaf(const bvh_build_result& result, const bvh_build_node& node, const std::vector<shared_ptr<hittable>>& objects)
 {
-	return box_compare(a, b, 0);
+	if (node.count == 1)
+		return objects[result.primitives[node.first].index];
+
+	auto list = make_shared<hittable_list>();
+	for (uint32_t i = node.first; i < node.first + node.count; ++i)
+		list->add(objects[result.primitives[i].index]);
+	return list;
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+// Creates the bvh_nodes for a subtree of the build result. The top levels are created in parallel.
+shared_ptr<hittable> make_bvh_subtree(const bvh_build_result& result, uint32_t index, const std::vector<shared_ptr<hittable>>& objects, int depth)
 {
-	return box_compare(a, b, 1);
+	const bvh_build_node& node = result.nodes[index];
+	if (node.count == 1)
+		return make_bvh_leaf(result, node, objects);
+	if (node.count > 1)
+	{
+		auto leaf = make_shared<bvh_node>(make_bvh_leaf(result, node, objects), nullptr, node.box);
+		leaf->update_sah_cost(node.box, node.box);
+		leaf->build_sah_cost = leaf->sah_cost;
+		return leaf;
+	}
+
+	shared_ptr<hittable> left;
+	shared_ptr<hittable> right;
+	if (depth < bvh_parallel_materialize_depth)
+	{
+		concurrency::parallel_invoke(
+			[&]() { left = make_bvh_subtree(result, node.first, objects, depth + 1); },
+			[&]() { right = make_bvh_subtree(result, node.second, objects, depth + 1); });
+	}
+	else
+	{
+		left = make_bvh_subtree(result, node.first, objects, depth + 1);
+		right = make_bvh_subtree(result, node.second, objects, depth + 1);
+	}
+	auto interior = make_shared<bvh_node>(left, right, node.box);
+	interior->update_sah_cost(result.nodes[node.first].box, result.nodes[node.second].box);
+	interior->build_sah_cost = interior->sah_cost;
+	return interior;
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+// SAH cost of a child: bvh_nodes know their cost, leaves cost one intersection per object
+double bvh_child_cost(const shared_ptr<hittable>& child)
 {
-	return box_compare(a, b, 2);
+	if (auto node = dynamic_cast<const bvh_node*>(child.get()))
+		return node->sah_cost;
+	if (auto list = dynamic_cast<const hittable_list*>(child.get()))
+		return sah_intersection_cost * list->objects.size();
+	return sah_intersection_cost;
 }
 
-// Constructs BVH: start and end arguments are needed for recursion arguments
-// Goal: Division should be done well: Two children of a node should have smaller bounding boxes
-// than their parent's bounding box (only for speed, not needed for correctness!)
-bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1)
+// Recursive form of the SAH: traversal_cost + (A_left * C_left + A_right * C_right) / A
+void bvh_node::update_sah_cost(const aabb& box_left, const aabb& box_right)
 {
-	// Randomly choose an axis and define comparator
-	int axis = random_int(0, 2);
-	auto comparator = (axis == 0) ? box_x_compare
-					: (axis == 1) ? box_y_compare
-								  : box_z_compare;
-
-	// How many objects are in objects
-	size_t object_span = end - start;
-
-	// For simplicity: If there is only one element, duplicate it in each subtree.
-	// Can be optimized but this way there are always two children
-	if (object_span == 1)
+	if (!right)
 	{
-		left  = objects[start];
-		right = objects[start];
+		sah_cost = bvh_child_cost(left);
+		return;
 	}
-	// If two elements: Put one in each subtree and end recursion
-	else if (object_span == 2)
+
+	const double area = box.surface_area();
+	const double cost_left = bvh_child_cost(left);
+	const double cost_right = bvh_child_cost(right);
+	if (area <= 0)
+		sah_cost = sah_traversal_cost + cost_left + cost_right;
+	else
+		sah_cost = sah_traversal_cost + (box_left.surface_area() * cost_left + box_right.surface_area() * cost_right) / area;
+}
+
+void bvh_node::refit(double time0, double time1)
+{
+	aabb box_left;
+	aabb box_right;
+
+	left->refit(time0, time1);
+	if (!left->bounding_box(time0, time1, box_left))
+		std::cerr << "No bounding box in bvh_node::refit.\n";
+
+	if (!right)
 	{
-		if (comparator(objects[start], objects[start + 1]))
-		{
-			left = objects[start];
-			right = objects[start + 1];
-		}
-		else
-		{
-			left = objects[start + 1];
-			right = objects[start];
-		}
+		box = box_left;
+		update_sah_cost(box_left, box_left);
+		return;
 	}
-	// Sort the primitives and construct tree recursively
-	else
+
+	right->refit(time0, time1);
+	if (!right->bounding_box(time0, time1, box_right))
+		std::cerr << "No bounding box in bvh_node::refit.\n";
+
+	box = surrounding_box(box_left, box_right);
+	update_sah_cost(box_left, box_right);
+}
+
+size_t bvh_node::refit(double time0, double time1, double rebuild_threshold)
+{
+	refit(time0, time1);
+	return rebuild_degraded(time0, time1, rebuild_threshold);
+}
+
+// Top-down, so a degraded subtree is rebuilt once as a whole instead of rebuilding its children first
+size_t bvh_node::rebuild_degraded(double time0, double time1, double rebuild_threshold)
+{
+	if (right && sah_cost > rebuild_threshold * build_sah_cost)
 	{
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
+		std::vector<shared_ptr<hittable>> objects;
+		collect_objects(objects);
 
-		auto mid = start + object_span / 2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		bvh_node rebuilt(objects, 0, objects.size(), time0, time1);
+		left = rebuilt.left;
+		right = rebuilt.right;
+		box = rebuilt.box;
+		sah_cost = rebuilt.sah_cost;
+		build_sah_cost = rebuilt.build_sah_cost;
+		return 1;
 	}
 
-	aabb box_left;
-	aabb box_right;
+	size_t rebuilt = 0;
+	if (auto node = dynamic_cast<bvh_node*>(left.get()))
+		rebuilt += node->rebuild_degraded(time0, time1, rebuild_threshold);
+	if (auto node = dynamic_cast<bvh_node*>(right.get()))
+		rebuilt += node->rebuild_degraded(time0, time1, rebuild_threshold);
+	return rebuilt;
+}
 
-	if (!left->bounding_box(time0, time1, box_left)
-		|| !right->bounding_box(time0, time1, box_right))
+// Gathers the objects of all leaves of the subtree
+void bvh_node::collect_objects(std::vector<shared_ptr<hittable>>& objects) const
+{
+	if (!right)
 	{
-		std::cerr << "No bounding box in bvh_node constructor.\n";
+		if (auto list = dynamic_cast<const hittable_list*>(left.get()))
+			objects.insert(objects.end(), list->objects.begin(), list->objects.end());
+		else
+			objects.push_back(left);
+		return;
 	}
 
-	box = surrounding_box(box_left, box_right);
+	for (const auto& child : { left, right })
+	{
+		if (auto node = dynamic_cast<const bvh_node*>(child.get()))
+			node->collect_objects(objects);
+		else
+			objects.push_back(child);
+	}
+}
+
+// Every node and leaf list is a separate allocation from make_shared, with the reference counts
+// (about two pointers) in front of the object.
+size_t bvh_node::memory_bytes() const
+{
+	const size_t shared_overhead = 2 * sizeof(void*);
+	size_t bytes = sizeof(bvh_node) + shared_overhead;
+	for (const auto& child : { left, right })
+	{
+		if (auto node = dynamic_cast<const bvh_node*>(child.get()))
+			bytes += node->memory_bytes();
+		else if (auto list = dynamic_cast<const hittable_list*>(child.get()))
+			bytes += sizeof(hittable_list) + shared_overhead + list->objects.capacity() * sizeof(shared_ptr<hittable>);
+		else if (child)
+			bytes += sizeof(shared_ptr<hittable>);
+	}
+	return bytes;
 }
 
 // Just return the box which is calculated during construction.
@@ -121,17 +267,29 @@ bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 }
 
 // Check whether the box for the node is hit, and if so, check the children and sort out any details
-bool bvh_node::hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+bool bvh_node::intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const
 {
 	if (!box.hit(r, tmin, tmax))
 		return false;
 
-	bool hit_left = left->hit(r, tmin, tmax, rec);
-	bool hit_right = right->hit(r, tmin, hit_left ? rec.t : tmax, rec);
+	bool hit_left = left->intersect(r, tmin, tmax, candidate, rec);
+	if (!right)
+		return hit_left;
+
+	bool hit_right = right->intersect(r, tmin, hit_left ? candidate.t : tmax, candidate, rec);
 
 	return hit_left || hit_right;
 }
 
+// No closest hit needed: the right child is only visited if nothing in the left one blocks the ray
+bool bvh_node::occluded(const ray& r, double tmin, double tmax) const
+{
+	if (!box.hit(r, tmin, tmax))
+		return false;
+
+	return left->occluded(r, tmin, tmax) || (right && right->occluded(r, tmin, tmax));
+}
+
 // Alternative implementation, according to github issue should be faster. Could not verify...
 //bool bvh_node::hit(const ray& r, double tmin, double tmax, hit_record& rec) const
 //{
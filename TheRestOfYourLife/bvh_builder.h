@@ -0,0 +1,806 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+
+#include <ppl.h>
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+
+
+// Parameters of the binned surface area heuristic (SAH). The cost of a split is
+// traversal_cost + intersection_cost * (A_left * N_left + A_right * N_right) / A_parent,
+// the cost of a leaf is intersection_cost * N. Costs are relative to each other only.
+const int sah_bin_count = 12;
+const double sah_traversal_cost = 1.0;
+const double sah_intersection_cost = 1.0;
+const size_t bvh_max_leaf_size = 4;
+
+// Maximum depth of a built tree (the root has depth 1). The flattened BVHs size their traversal
+// stacks by it. Subtrees that would get deeper are split at the median instead.
+const int bvh_max_depth = 64;
+
+// Subtrees with more primitives than this are built as separate tasks
+const size_t bvh_task_threshold = 4096;
+// Nodes with more primitives than this compute their bounds and SAH bins in parallel chunks
+const size_t bvh_parallel_binning_threshold = 1 << 16;
+
+
+// Options of a build. The defaults give a plain object partitioning BVH.
+struct bvh_build_options
+{
+	// Spatial splits (SBVH): Besides partitioning the primitives, a node may be split at a plane,
+	// and primitives straddling the plane are referenced by both children with their boxes clipped
+	// to each side. Helps where large primitives (walls, big rects) make sibling boxes overlap.
+	bool spatial_splits = false;
+
+	// Upper bound for the number of primitive references, relative to the number of primitives
+	double max_reference_growth = 1.5;
+
+	// Spatial splits are only tried where the children of the best object split overlap by more than
+	// this fraction of the root surface area (alpha in Stich et al., "Spatial Splits in BVHs")
+	double spatial_split_alpha = 1e-5;
+};
+
+// Statistics of a build. Overlaps are surface areas of the intersection of sibling boxes,
+// summed over all interior nodes and relative to the root surface area.
+struct bvh_build_stats
+{
+	size_t primitive_count = 0;
+	size_t reference_count = 0;
+	size_t spatial_split_count = 0;
+	double sibling_overlap = 0;		// overlap left in the final tree
+	double removed_overlap = 0;		// overlap of the best object splits replaced by spatial splits
+};
+
+// Everything the builder needs to know about a primitive. Computed once up front, so the build
+// itself never calls the virtual bounding_box().
+struct bvh_primitive
+{
+	aabb box;
+	vec3 centroid;
+	uint32_t index;		// index of the primitive in the list the BVH is built for
+};
+
+struct bvh_build_node
+{
+	aabb box;
+	uint32_t first;		// leaf: first primitive in bvh_build_result::primitives, interior: left child
+	uint32_t second;	// interior: right child
+	uint32_t count;		// number of primitives of a leaf, 0 for interior nodes
+	int axis;			// interior: split axis
+};
+
+// Flat result of a build: nodes[0] is the root, leaves reference ranges of primitives.
+// With spatial splits the same primitive (index) can be referenced by several leaves.
+struct bvh_build_result
+{
+	std::vector<bvh_build_node> nodes;
+	std::vector<bvh_primitive> primitives;
+	bvh_build_stats stats;
+};
+
+// Surface area of the intersection of two boxes, 0 if they are disjoint
+inline double overlap_area(const aabb& a, const aabb& b)
+{
+	vec3 lo;
+	vec3 hi;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		lo[axis] = std::max(a.min()[axis], b.min()[axis]);
+		hi[axis] = std::min(a.max()[axis], b.max()[axis]);
+		if (hi[axis] < lo[axis])
+			return 0;
+	}
+	return aabb(lo, hi).surface_area();
+}
+
+// Boxes and centroids of objects[start, end), gathered in parallel.
+std::vector<bvh_primitive> make_bvh_primitives(
+	const std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1)
+{
+	std::vector<bvh_primitive> primitives(end - start);
+	concurrency::parallel_for(size_t(0), end - start, [&](size_t i)
+	{
+		bvh_primitive& prim = primitives[i];
+		if (!objects[start + i]->bounding_box(time0, time1, prim.box))
+			std::cerr << "No bounding box in bvh_node constructor.\n";
+		prim.centroid = prim.box.centroid();
+		prim.index = static_cast<uint32_t>(start + i);
+	});
+	return primitives;
+}
+
+
+struct sah_bin
+{
+	size_t count = 0;
+	aabb box;
+
+	void add(const aabb& b, size_t n)
+	{
+		if (n == 0)
+			return;
+		if (count == 0)
+			box = b;
+		else
+			box.expand(b);
+		count += n;
+	}
+};
+
+inline int sah_bin_index(double centroid, double cmin, double extent)
+{
+	return std::min(sah_bin_count - 1, static_cast<int>(sah_bin_count * (centroid - cmin) / extent));
+}
+
+// Best split found by a SAH sweep over bins. axis < 0 if there is no valid split.
+struct sah_split
+{
+	int axis = -1;
+	int bin = 0;
+	double cost = infinity;
+	aabb left_box;
+	aabb right_box;
+	size_t left_count = 0;
+	size_t right_count = 0;
+};
+
+// Bin of a spatial split: box of all reference parts clipped to the bin, and the number of
+// references starting (entries) and ending (exits) in it
+struct spatial_bin
+{
+	sah_bin bounds;
+	size_t entries = 0;
+	size_t exits = 0;
+};
+
+// Keeps the split of axis between bin b - 1 and b in best if it is cheaper
+inline void sah_consider(sah_split& best, int axis, int b, double parent_area, const sah_bin& left, const sah_bin& right, size_t left_count, size_t right_count)
+{
+	if (left_count == 0 || right_count == 0)
+		return;
+
+	double cost = sah_traversal_cost + sah_intersection_cost
+		* (left.box.surface_area() * left_count + right.box.surface_area() * right_count) / parent_area;
+	if (cost < best.cost)
+	{
+		best.cost = cost;
+		best.axis = axis;
+		best.bin = b;
+		best.left_box = left.box;
+		best.right_box = right.box;
+		best.left_count = left_count;
+		best.right_count = right_count;
+	}
+}
+
+// Sweeps over the centroid bins of axis and keeps the best object split
+inline void sah_sweep(const sah_bin bins[sah_bin_count], int axis, double parent_area, sah_split& best)
+{
+	// Sweep from the right to get area and count of everything right of each split plane ...
+	sah_bin right[sah_bin_count];
+	sah_bin acc;
+	for (int b = sah_bin_count - 1; b > 0; --b)
+	{
+		acc.add(bins[b].box, bins[b].count);
+		right[b] = acc;
+	}
+
+	// ... and from the left to evaluate the cost of splitting between bin b - 1 and b.
+	acc = sah_bin();
+	for (int b = 1; b < sah_bin_count; ++b)
+	{
+		acc.add(bins[b - 1].box, bins[b - 1].count);
+		sah_consider(best, axis, b, parent_area, acc, right[b], acc.count, right[b].count);
+	}
+}
+
+// Same for spatial bins: left of a plane are all entries before it, right of it all exits after it
+inline void sah_sweep(const spatial_bin bins[sah_bin_count], int axis, double parent_area, sah_split& best)
+{
+	sah_bin right[sah_bin_count];
+	size_t right_count[sah_bin_count];
+	sah_bin acc;
+	size_t count = 0;
+	for (int b = sah_bin_count - 1; b > 0; --b)
+	{
+		acc.add(bins[b].bounds.box, bins[b].bounds.count);
+		count += bins[b].exits;
+		right[b] = acc;
+		right_count[b] = count;
+	}
+
+	acc = sah_bin();
+	count = 0;
+	for (int b = 1; b < sah_bin_count; ++b)
+	{
+		acc.add(bins[b - 1].bounds.box, bins[b - 1].bounds.count);
+		count += bins[b - 1].entries;
+		sah_consider(best, axis, b, parent_area, acc, right[b], count, right_count[b]);
+	}
+}
+
+// Bounds and centroid bounds of a range of primitives
+struct bvh_range_bounds
+{
+	aabb bounds;
+	aabb centroid_bounds;
+	bool empty = true;
+
+	void add(const aabb& box, const aabb& centroids)
+	{
+		if (empty)
+		{
+			bounds = box;
+			centroid_bounds = centroids;
+			empty = false;
+			return;
+		}
+		bounds.expand(box);
+		centroid_bounds.expand(centroids);
+	}
+
+	void add(const bvh_primitive& prim)
+	{
+		if (empty)
+		{
+			bounds = prim.box;
+			centroid_bounds = aabb(prim.centroid, prim.centroid);
+			empty = false;
+			return;
+		}
+		bounds.expand(prim.box);
+		centroid_bounds.expand(prim.centroid);
+	}
+};
+
+// True if a subtree of count primitives at depth could exceed bvh_max_depth unless it is split at
+// the median from here on. A median split halves the count, so the subtree then ends ceil(log2(count))
+// levels further down at most.
+inline bool depth_limited(int depth, size_t count)
+{
+	int levels = 0;
+	while ((size_t(1) << levels) < count)
+		++levels;
+	return depth + levels >= bvh_max_depth;
+}
+
+// Partitions refs at count / 2 along the axis the centroids spread most and returns that axis
+inline int median_split(bvh_primitive* refs, size_t count, const aabb& centroid_bounds)
+{
+	const vec3 extent = centroid_bounds.max() - centroid_bounds.min();
+	int axis = 0;
+	for (int a = 1; a < 3; ++a)
+		if (extent[a] > extent[axis]) axis = a;
+
+	std::nth_element(refs, refs + count / 2, refs + count, [axis](const bvh_primitive& a, const bvh_primitive& b)
+	{
+		return a.centroid[axis] < b.centroid[axis];
+	});
+	return axis;
+}
+
+
+/* Binned SAH builder working on flat arrays of primitive references. The primitive array is
+   partitioned in place, so every node owns a contiguous range of it. Large subtrees are built as
+   independent tasks and large nodes bin their primitives in parallel chunks. Node slots are
+   handed out through an atomic counter, so tasks never have to synchronize otherwise.
+   With spatial splits, references can be duplicated, so every node gets its own array of
+   references instead and leaves copy theirs into the output through a second atomic counter. */
+class bvh_builder
+{
+	public:
+		explicit bvh_builder(const bvh_build_options& build_options = bvh_build_options())
+			: options(build_options)
+		{}
+
+		bvh_build_result build(std::vector<bvh_primitive> primitives);
+
+	private:
+		uint32_t build_range(size_t begin, size_t end, int depth);
+		uint32_t build_children(uint32_t index, size_t begin, size_t mid, size_t end, int depth);
+		uint32_t build_spatial(std::vector<bvh_primitive>& refs, int depth);
+		uint32_t build_spatial_children(uint32_t index, std::vector<bvh_primitive>& left_refs, std::vector<bvh_primitive>& right_refs,
+			size_t span, int depth);
+		sah_split find_object_split(const bvh_primitive* refs, size_t count, const bvh_range_bounds& bounds, double parent_area) const;
+		sah_split find_spatial_split(const std::vector<bvh_primitive>& refs, const aabb& box, double parent_area) const;
+		uint32_t make_leaf(uint32_t index, std::vector<bvh_primitive>& refs);
+		bool reserve_references(size_t count);
+		double sibling_overlap() const;
+
+		bvh_range_bounds range_bounds(const bvh_primitive* refs, size_t count) const;
+		void range_bins(const bvh_primitive* refs, size_t count, const aabb& centroid_bounds, sah_bin bins[3][sah_bin_count]) const;
+
+		// Splits [begin, end) into chunk_count(end - begin) chunks and runs f(chunk, chunk_begin, chunk_end),
+		// in parallel for large ranges
+		template <typename F>
+		void for_each_chunk(size_t begin, size_t end, F&& f) const;
+		size_t chunk_count(size_t span) const;
+
+		bvh_build_options options;
+		std::vector<bvh_primitive> prims;
+		std::vector<bvh_build_node> nodes;
+		std::atomic<uint32_t> node_count{ 0 };
+
+		// Spatial splits only
+		size_t max_references = 0;
+		std::atomic<size_t> reference_count{ 0 };
+		std::atomic<uint32_t> output_count{ 0 };
+		double root_area = 0;
+		std::mutex stats_mutex;
+		bvh_build_stats stats;
+};
+
+bvh_build_result bvh_builder::build(std::vector<bvh_primitive> primitives)
+{
+	bvh_build_result result;
+	if (primitives.empty())
+		return result;
+
+	stats = bvh_build_stats();
+	stats.primitive_count = primitives.size();
+	node_count = 0;
+
+	if (options.spatial_splits)
+	{
+		max_references = std::max(primitives.size(), static_cast<size_t>(options.max_reference_growth * primitives.size()));
+		reference_count = primitives.size();
+		output_count = 0;
+		root_area = range_bounds(primitives.data(), primitives.size()).bounds.surface_area();
+
+		// A binary tree with at least one reference per leaf has at most 2n - 1 nodes
+		nodes.resize(2 * max_references - 1);
+		prims.resize(max_references);
+		build_spatial(primitives, 1);
+		prims.resize(output_count);
+	}
+	else
+	{
+		prims = std::move(primitives);
+		nodes.resize(2 * prims.size() - 1);
+		build_range(0, prims.size(), 1);
+	}
+	nodes.resize(node_count);
+
+	stats.reference_count = prims.size();
+	stats.sibling_overlap = sibling_overlap();
+
+	result.nodes = std::move(nodes);
+	result.primitives = std::move(prims);
+	result.stats = stats;
+	return result;
+}
+
+double bvh_builder::sibling_overlap() const
+{
+	const double area = nodes[0].box.surface_area();
+	if (area <= 0)
+		return 0;
+
+	double overlap = 0;
+	for (const auto& node : nodes)
+		if (node.count == 0)
+			overlap += overlap_area(nodes[node.first].box, nodes[node.second].box);
+	return overlap / area;
+}
+
+size_t bvh_builder::chunk_count(size_t span) const
+{
+	const size_t chunk_size = bvh_parallel_binning_threshold / 4;
+	return span <= bvh_parallel_binning_threshold ? 1 : (span + chunk_size - 1) / chunk_size;
+}
+
+template <typename F>
+void bvh_builder::for_each_chunk(size_t begin, size_t end, F&& f) const
+{
+	const size_t chunks = chunk_count(end - begin);
+	if (chunks == 1)
+	{
+		f(size_t(0), begin, end);
+		return;
+	}
+
+	const size_t chunk_size = bvh_parallel_binning_threshold / 4;
+	concurrency::parallel_for(size_t(0), chunks, [&](size_t c)
+	{
+		f(c, begin + c * chunk_size, std::min(end, begin + (c + 1) * chunk_size));
+	});
+}
+
+bvh_range_bounds bvh_builder::range_bounds(const bvh_primitive* refs, size_t count) const
+{
+	if (chunk_count(count) == 1)
+	{
+		bvh_range_bounds result;
+		for (size_t i = 0; i < count; ++i)
+			result.add(refs[i]);
+		return result;
+	}
+
+	std::vector<bvh_range_bounds> partial(chunk_count(count));
+	for_each_chunk(0, count, [&](size_t c, size_t b, size_t e)
+	{
+		for (size_t i = b; i < e; ++i)
+			partial[c].add(refs[i]);
+	});
+
+	bvh_range_bounds result;
+	for (const auto& p : partial)
+		if (!p.empty)
+			result.add(p.bounds, p.centroid_bounds);
+	return result;
+}
+
+void bvh_builder::range_bins(const bvh_primitive* refs, size_t count, const aabb& centroid_bounds, sah_bin bins[3][sah_bin_count]) const
+{
+	auto bin_range = [&](size_t b, size_t e, sah_bin out[3][sah_bin_count])
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const double cmin = centroid_bounds.min()[axis];
+			const double extent = centroid_bounds.max()[axis] - cmin;
+			if (extent <= 0)
+				continue;
+
+			for (size_t i = b; i < e; ++i)
+				out[axis][sah_bin_index(refs[i].centroid[axis], cmin, extent)].add(refs[i].box, 1);
+		}
+	};
+
+	if (chunk_count(count) == 1)
+	{
+		bin_range(0, count, bins);
+		return;
+	}
+
+	struct chunk_bins
+	{
+		sah_bin bins[3][sah_bin_count];
+	};
+
+	std::vector<chunk_bins> partial(chunk_count(count));
+	for_each_chunk(0, count, [&](size_t c, size_t b, size_t e)
+	{
+		bin_range(b, e, partial[c].bins);
+	});
+
+	for (const auto& p : partial)
+		for (int axis = 0; axis < 3; ++axis)
+			for (int b = 0; b < sah_bin_count; ++b)
+				bins[axis][b].add(p.bins[axis][b].box, p.bins[axis][b].count);
+}
+
+// Bins all three axes by centroid and returns the object split with the lowest SAH cost
+sah_split bvh_builder::find_object_split(const bvh_primitive* refs, size_t count, const bvh_range_bounds& bounds, double parent_area) const
+{
+	sah_bin bins[3][sah_bin_count];
+	range_bins(refs, count, bounds.centroid_bounds, bins);
+
+	sah_split best;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		if (bounds.centroid_bounds.max()[axis] - bounds.centroid_bounds.min()[axis] <= 0)
+			continue;
+		sah_sweep(bins[axis], axis, parent_area, best);
+	}
+	return best;
+}
+
+// Goal: Division should be done well: Two children of a node should have smaller bounding boxes
+// than their parent's bounding box (only for speed, not needed for correctness!)
+// All three axes are binned by centroid and the split with the lowest SAH cost is taken. If no split
+// is cheaper than intersecting all primitives directly, the primitives become a leaf.
+uint32_t bvh_builder::build_range(size_t begin, size_t end, int depth)
+{
+	const uint32_t index = node_count++;
+	bvh_build_node& node = nodes[index];
+	const size_t span = end - begin;
+
+	bvh_range_bounds bounds = range_bounds(prims.data() + begin, span);
+	node.box = bounds.bounds;
+	node.count = 0;
+	node.axis = 0;
+
+	if (span == 1)
+	{
+		node.first = static_cast<uint32_t>(begin);
+		node.count = 1;
+		return index;
+	}
+
+	if (depth_limited(depth, span))
+	{
+		if (span <= bvh_max_leaf_size)
+		{
+			node.first = static_cast<uint32_t>(begin);
+			node.count = static_cast<uint32_t>(span);
+			return index;
+		}
+		node.axis = median_split(prims.data() + begin, span, bounds.centroid_bounds);
+		return build_children(index, begin, begin + span / 2, end, depth);
+	}
+
+	const sah_split best = find_object_split(prims.data() + begin, span, bounds, node.box.surface_area());
+
+	const double leaf_cost = sah_intersection_cost * span;
+	if (span <= bvh_max_leaf_size && (best.axis < 0 || best.cost >= leaf_cost))
+	{
+		node.first = static_cast<uint32_t>(begin);
+		node.count = static_cast<uint32_t>(span);
+		return index;
+	}
+
+	size_t mid = begin;
+	if (best.axis >= 0)
+	{
+		const double cmin = bounds.centroid_bounds.min()[best.axis];
+		const double extent = bounds.centroid_bounds.max()[best.axis] - cmin;
+		auto it = std::partition(prims.begin() + begin, prims.begin() + end, [&](const bvh_primitive& prim)
+		{
+			return sah_bin_index(prim.centroid[best.axis], cmin, extent) < best.bin;
+		});
+		mid = it - prims.begin();
+	}
+
+	// All centroids coincide (or the best split is empty on one side): split in the middle
+	if (mid == begin || mid == end)
+		mid = begin + span / 2;
+
+	node.axis = best.axis < 0 ? 0 : best.axis;
+	return build_children(index, begin, mid, end, depth);
+}
+
+// Builds [begin, mid) and [mid, end) as the children of nodes[index]
+uint32_t bvh_builder::build_children(uint32_t index, size_t begin, size_t mid, size_t end, int depth)
+{
+	uint32_t left = 0;
+	uint32_t right = 0;
+	if (end - begin > bvh_task_threshold)
+	{
+		concurrency::parallel_invoke(
+			[&]() { left = build_range(begin, mid, depth + 1); },
+			[&]() { right = build_range(mid, end, depth + 1); });
+	}
+	else
+	{
+		left = build_range(begin, mid, depth + 1);
+		right = build_range(mid, end, depth + 1);
+	}
+
+	// nodes is never resized during the build, so the node is still valid here
+	bvh_build_node& node = nodes[index];
+	node.first = left;
+	node.second = right;
+	return index;
+}
+
+// Box of ref clipped to the slab [lo, hi] along axis
+inline bvh_primitive clip_reference(const bvh_primitive& ref, int axis, double lo, double hi)
+{
+	vec3 min = ref.box.min();
+	vec3 max = ref.box.max();
+	min[axis] = std::max(min[axis], lo);
+	max[axis] = std::min(max[axis], hi);
+
+	bvh_primitive clipped = ref;
+	clipped.box = aabb(min, max);
+	clipped.centroid = clipped.box.centroid();
+	return clipped;
+}
+
+/* Spatial split binning: bins are equally sized slabs of the node box. Every reference is clipped
+   to all bins it overlaps and counted as entering in its first and exiting in its last bin, so a
+   plane between bins has the entries left of it and the exits right of it on each side. */
+sah_split bvh_builder::find_spatial_split(const std::vector<bvh_primitive>& refs, const aabb& box, double parent_area) const
+{
+	sah_split best;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const double origin = box.min()[axis];
+		const double width = (box.max()[axis] - origin) / sah_bin_count;
+		if (width <= 0)
+			continue;
+
+		spatial_bin bins[sah_bin_count];
+		for (const auto& ref : refs)
+		{
+			int first = static_cast<int>((ref.box.min()[axis] - origin) / width);
+			int last = static_cast<int>((ref.box.max()[axis] - origin) / width);
+			first = std::max(0, std::min(sah_bin_count - 1, first));
+			last = std::max(first, std::min(sah_bin_count - 1, last));
+
+			for (int b = first; b <= last; ++b)
+				bins[b].bounds.add(clip_reference(ref, axis, origin + b * width, origin + (b + 1) * width).box, 1);
+			++bins[first].entries;
+			++bins[last].exits;
+		}
+		sah_sweep(bins, axis, parent_area, best);
+	}
+	return best;
+}
+// Takes count more references out of the growth budget, fails if that would exceed it
+bool bvh_builder::reserve_references(size_t count)
+{
+	size_t current = reference_count.load();
+	while (current + count <= max_references)
+	{
+		if (reference_count.compare_exchange_weak(current, current + count))
+			return true;
+	}
+	return false;
+}
+
+uint32_t bvh_builder::make_leaf(uint32_t index, std::vector<bvh_primitive>& refs)
+{
+	const uint32_t first = output_count.fetch_add(static_cast<uint32_t>(refs.size()));
+	std::copy(refs.begin(), refs.end(), prims.begin() + first);
+
+	bvh_build_node& node = nodes[index];
+	node.first = first;
+	node.count = static_cast<uint32_t>(refs.size());
+	return index;
+}
+
+// SBVH node: the best object split is compared with the best spatial split. Spatial splits are only
+// searched where the object split leaves overlapping children, and only taken while the duplicated
+// references fit into the growth budget. refs is consumed.
+uint32_t bvh_builder::build_spatial(std::vector<bvh_primitive>& refs, int depth)
+{
+	const uint32_t index = node_count++;
+	const size_t span = refs.size();
+
+	bvh_range_bounds bounds = range_bounds(refs.data(), span);
+	{
+		bvh_build_node& node = nodes[index];
+		node.box = bounds.bounds;
+		node.count = 0;
+		node.axis = 0;
+	}
+
+	if (span == 1)
+		return make_leaf(index, refs);
+
+	// Past the depth budget: median splits without duplicating references
+	if (depth_limited(depth, span))
+	{
+		if (span <= bvh_max_leaf_size)
+			return make_leaf(index, refs);
+		nodes[index].axis = median_split(refs.data(), span, bounds.centroid_bounds);
+		std::vector<bvh_primitive> left_refs(refs.begin(), refs.begin() + span / 2);
+		std::vector<bvh_primitive> right_refs(refs.begin() + span / 2, refs.end());
+		std::vector<bvh_primitive>().swap(refs);
+		return build_spatial_children(index, left_refs, right_refs, span, depth);
+	}
+
+	const double parent_area = bounds.bounds.surface_area();
+	const sah_split object = find_object_split(refs.data(), span, bounds, parent_area);
+
+	const double object_overlap = object.axis >= 0 ? overlap_area(object.left_box, object.right_box) : 0;
+	sah_split spatial;
+	if (root_area > 0 && object_overlap / root_area > options.spatial_split_alpha)
+		spatial = find_spatial_split(refs, bounds.bounds, parent_area);
+
+	const double best_cost = std::min(object.cost, spatial.cost);
+	if (span <= bvh_max_leaf_size && best_cost >= sah_intersection_cost * span)
+		return make_leaf(index, refs);
+
+	std::vector<bvh_primitive> left_refs;
+	std::vector<bvh_primitive> right_refs;
+	int axis = object.axis < 0 ? 0 : object.axis;
+
+	if (spatial.cost < object.cost)
+	{
+		const int a = spatial.axis;
+		const double plane = bounds.bounds.min()[a] + spatial.bin * (bounds.bounds.max()[a] - bounds.bounds.min()[a]) / sah_bin_count;
+
+		size_t straddling = 0;
+		for (const auto& ref : refs)
+			if (ref.box.min()[a] < plane && ref.box.max()[a] > plane)
+				++straddling;
+
+		if (reserve_references(straddling))
+		{
+			left_refs.reserve(spatial.left_count);
+			right_refs.reserve(spatial.right_count);
+			for (const auto& ref : refs)
+			{
+				if (ref.box.max()[a] <= plane)
+					left_refs.push_back(ref);
+				else if (ref.box.min()[a] >= plane)
+					right_refs.push_back(ref);
+				else
+				{
+					left_refs.push_back(clip_reference(ref, a, -infinity, plane));
+					right_refs.push_back(clip_reference(ref, a, plane, infinity));
+				}
+			}
+
+			if (left_refs.empty() || right_refs.empty())
+			{
+				// Cannot happen for a valid split, but never recurse on the same set of references
+				reference_count -= straddling;
+				left_refs.clear();
+				right_refs.clear();
+			}
+			else
+			{
+				axis = a;
+				std::lock_guard<std::mutex> lock(stats_mutex);
+				++stats.spatial_split_count;
+				stats.removed_overlap += (object_overlap - overlap_area(spatial.left_box, spatial.right_box)) / root_area;
+			}
+		}
+	}
+
+	if (left_refs.empty())
+	{
+		// Object split (or median split if the centroids coincide), same as build_range
+		auto mid = refs.begin() + span / 2;
+		if (object.axis >= 0)
+		{
+			const double cmin = bounds.centroid_bounds.min()[object.axis];
+			const double extent = bounds.centroid_bounds.max()[object.axis] - cmin;
+			auto it = std::partition(refs.begin(), refs.end(), [&](const bvh_primitive& ref)
+			{
+				return sah_bin_index(ref.centroid[object.axis], cmin, extent) < object.bin;
+			});
+			if (it != refs.begin() && it != refs.end())
+				mid = it;
+		}
+		left_refs.assign(refs.begin(), mid);
+		right_refs.assign(mid, refs.end());
+	}
+
+	// The references of this node are not needed anymore while the children are built
+	std::vector<bvh_primitive>().swap(refs);
+
+	nodes[index].axis = axis;
+	return build_spatial_children(index, left_refs, right_refs, span, depth);
+}
+
+uint32_t bvh_builder::build_spatial_children(uint32_t index, std::vector<bvh_primitive>& left_refs, std::vector<bvh_primitive>& right_refs,
+	size_t span, int depth)
+{
+	uint32_t left = 0;
+	uint32_t right = 0;
+	if (span > bvh_task_threshold)
+	{
+		concurrency::parallel_invoke(
+			[&]() { left = build_spatial(left_refs, depth + 1); },
+			[&]() { right = build_spatial(right_refs, depth + 1); });
+	}
+	else
+	{
+		left = build_spatial(left_refs, depth + 1);
+		right = build_spatial(right_refs, depth + 1);
+	}
+
+	bvh_build_node& node = nodes[index];
+	node.first = left;
+	node.second = right;
+	return index;
+}
+
+// Builds a BVH over the given primitive references
+bvh_build_result build_bvh(std::vector<bvh_primitive> primitives, const bvh_build_options& options = bvh_build_options())
+{
+	bvh_builder builder(options);
+	return builder.build(std::move(primitives));
+}
+
+// Prints the statistics of a build, e.g. to see how much overlap spatial splits removed
+void print_bvh_build_stats(const char* name, const bvh_build_stats& stats)
+{
+	std::cout	<< std::left << std::setw(16) << name << std::right
+				<< " primitives " << stats.primitive_count
+				<< "  references " << stats.reference_count
+				<< "  spatial splits " << stats.spatial_split_count
+				<< std::fixed << std::setprecision(4)
+				<< "  sibling overlap " << stats.sibling_overlap
+				<< "  removed overlap " << stats.removed_overlap << '\n';
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+
+/* Cache of built BVHs on disk. A linear_bvh is stored as its node array plus, for every primitive
+   slot, the index of the object in the scene list. The file name contains a hash of the scene
+   geometry (type and bounding box of every object), so a changed scene never loads a stale tree.
+   Files are read through a memory mapping and the node array is copied out of it in one piece:
+   loading is a sequential read without any parsing, and the nodes stay writable for refit(). */
+
+// Increase whenever linear_bvh_node or the file layout changes
+const uint32_t bvh_cache_version = 2;
+
+// First 64 bytes of a cache file. Nodes follow directly (64 byte aligned), then the primitive indices.
+struct bvh_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;
+	uint64_t key;
+	uint64_t node_count;
+	uint64_t primitive_count;
+	uint8_t pad[24];
+};
+
+static_assert(sizeof(bvh_cache_header) == 64, "bvh_cache_header has to keep the nodes aligned");
+
+const char bvh_cache_magic[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 0, 0 };
+
+
+// 64 bit FNV-1a
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Hash of everything the BVH build depends on: number, types and boxes of the objects and the shutter interval
+uint64_t hash_bvh_scene(const hittable_list& list, double time0, double time1)
+{
+	uint64_t hash = fnv1a(&bvh_cache_version, sizeof(bvh_cache_version));
+	const uint64_t count = list.objects.size();
+	hash = fnv1a(&count, sizeof(count), hash);
+	hash = fnv1a(&time0, sizeof(time0), hash);
+	hash = fnv1a(&time1, sizeof(time1), hash);
+
+	for (const auto& object : list.objects)
+	{
+		const char* type = typeid(*object).name();
+		hash = fnv1a(type, std::strlen(type), hash);
+
+		aabb box;
+		if (!object->bounding_box(time0, time1, box))
+			std::cerr << "No bounding box in hash_bvh_scene.\n";
+
+		const double coords[6] = { box.min().x(), box.min().y(), box.min().z(), box.max().x(), box.max().y(), box.max().z() };
+		hash = fnv1a(coords, sizeof(coords), hash);
+	}
+	return hash;
+}
+
+std::string bvh_cache_path(const std::string& prefix, uint64_t key)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex(16, '0');
+	for (int i = 15; i >= 0; --i, key >>= 4)
+		hex[i] = digits[key & 0xf];
+	return prefix + hex + ".bvh";
+}
+
+
+// Writes bvh, built over list, to path. Fails if the BVH references objects that are not in the list.
+bool save_linear_bvh(const linear_bvh& bvh, const hittable_list& list, uint64_t key, const std::string& path)
+{
+	std::unordered_map<const hittable*, uint32_t> index_of;
+	index_of.reserve(list.objects.size());
+	for (size_t i = 0; i < list.objects.size(); ++i)
+		index_of.emplace(list.objects[i].get(), static_cast<uint32_t>(i));
+
+	std::vector<uint32_t> indices(bvh.primitives.size());
+	for (size_t i = 0; i < bvh.primitives.size(); ++i)
+	{
+		auto it = index_of.find(bvh.primitives[i].get());
+		if (it == index_of.end())
+			return false;
+		indices[i] = it->second;
+	}
+
+	bvh_cache_header header = {};
+	std::memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+	header.version = bvh_cache_version;
+	header.node_size = sizeof(linear_bvh_node);
+	header.key = key;
+	header.node_count = bvh.nodes.size();
+	header.primitive_count = indices.size();
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+		return false;
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(bvh.nodes.data()), bvh.nodes.size() * sizeof(linear_bvh_node));
+	file.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(uint32_t));
+	return static_cast<bool>(file);
+}
+
+// Checks that every node of a loaded tree references existing nodes and primitives, that children
+// come after their parent (which rules out cycles) and that the tree fits the traversal stack
+bool valid_linear_bvh_nodes(const linear_bvh_nodes& nodes, size_t primitive_count)
+{
+	std::vector<int> depth(nodes.size(), 0);
+	depth[0] = 1;
+	if (nodes.size() > 1)
+		depth[1] = 1;
+
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		const linear_bvh_node& node = nodes[i];
+		if (node.prim_count > 0)
+		{
+			if (static_cast<size_t>(node.offset) + node.prim_count > primitive_count)
+				return false;
+			continue;
+		}
+
+		if (node.axis > 2 || node.offset <= i || static_cast<size_t>(node.offset) + 1 >= nodes.size())
+			return false;
+		for (uint32_t child = node.offset; child <= node.offset + 1; ++child)
+			depth[child] = std::max(depth[child], depth[i] + 1);
+		if (depth[i] + 1 > linear_bvh_max_depth)
+			return false;
+	}
+	return true;
+}
+
+// Loads the BVH of list from path. Returns nullptr if the file is missing, from an older version,
+// was written for a different scene or is corrupt.
+shared_ptr<linear_bvh> load_linear_bvh(hittable_list& list, uint64_t key, const std::string& path)
+{
+	mapped_file file(path);
+	if (!file.valid() || file.size() < sizeof(bvh_cache_header))
+		return nullptr;
+
+	bvh_cache_header header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	if (std::memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0
+		|| header.version != bvh_cache_version
+		|| header.node_size != sizeof(linear_bvh_node)
+		|| header.key != key
+		|| header.node_count == 0
+		|| header.node_count > file.size() / sizeof(linear_bvh_node)
+		|| header.primitive_count > file.size() / sizeof(uint32_t))
+		return nullptr;
+
+	const size_t node_bytes = header.node_count * sizeof(linear_bvh_node);
+	const size_t index_bytes = header.primitive_count * sizeof(uint32_t);
+	if (file.size() != sizeof(header) + node_bytes + index_bytes)
+		return nullptr;
+
+	linear_bvh_nodes nodes(header.node_count);
+	std::memcpy(nodes.data(), file.data() + sizeof(header), node_bytes);
+	if (!valid_linear_bvh_nodes(nodes, header.primitive_count))
+		return nullptr;
+
+	const uint32_t* indices = reinterpret_cast<const uint32_t*>(file.data() + sizeof(header) + node_bytes);
+	std::vector<shared_ptr<hittable>> primitives(header.primitive_count);
+	for (size_t i = 0; i < primitives.size(); ++i)
+	{
+		if (indices[i] >= list.objects.size())
+			return nullptr;
+		primitives[i] = list.objects[indices[i]];
+	}
+
+	return make_shared<linear_bvh>(std::move(nodes), std::move(primitives));
+}
+
+// Loads the BVH from the cache file for this scene, or builds it and writes the cache file.
+// The file name is path_prefix followed by the scene hash.
+shared_ptr<linear_bvh> load_or_build_linear_bvh(hittable_list& list, double time0, double time1, const std::string& path_prefix)
+{
+	const uint64_t key = hash_bvh_scene(list, time0, time1);
+	const std::string path = bvh_cache_path(path_prefix, key);
+
+	if (auto cached = load_linear_bvh(list, key, path))
+		return cached;
+
+	auto bvh = make_shared<linear_bvh>(list, time0, time1);
+	if (!save_linear_bvh(*bvh, list, key, path))
+		std::cerr << "Could not write BVH cache " << path << ".\n";
+	return bvh;
+}
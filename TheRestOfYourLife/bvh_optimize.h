@@ -0,0 +1,364 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "camera.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+/* View dependent BVH optimization. The SAH assumes rays are distributed uniformly, but a fixed camera
+   sends most rays into a few regions of the scene. Here a small pilot set of camera and bounce rays
+   is traced once, and the tree is then changed with rotations (Kensler, "Tree Rotations for
+   Improving Bounding Volume Hierarchies") where that lowers the cost measured on these rays.
+   The cost is measured by replaying the front to back traversal of linear_bvh: A rotation that only
+   shrinks the boxes the rays pass through can still make the traversal find the closest hit later,
+   so simply counting the boxes a ray segment overlaps is not enough. */
+
+// Pilot ray with the distance to its closest hit (infinity if it left the scene). Rays can be traced
+// through more than the tree that is optimized, e.g. a whole scene with a ground plane outside the
+// BVH. If that hit lies outside the tree, the replay starts with tmax as bound, like the traversal of
+// a scene that tests its large objects first.
+struct pilot_ray
+{
+	ray r;
+	double tmax;
+};
+
+struct ray_optimization_report
+{
+	size_t pilot_rays = 0;
+	size_t rotations = 0;
+	double cost_before = 0;		// node visits * traversal cost + primitive tests * intersection cost
+	double cost_after = 0;
+};
+
+// One jittered camera ray per pixel plus up to bounces scattered rays per path
+std::vector<pilot_ray> trace_pilot_rays(const hittable& world, camera& cam, int width, int height, int bounces)
+{
+	std::vector<pilot_ray> rays;
+	rays.reserve(static_cast<size_t>(width) * height * (bounces + 1));
+
+	for (int j = 0; j < height; ++j)
+	{
+		for (int i = 0; i < width; ++i)
+		{
+			ray r = cam.get_ray((i + random_double()) / width, (j + random_double()) / height);
+			for (int depth = 0; depth <= bounces; ++depth)
+			{
+				hit_record rec;
+				if (!world.hit(r, epsilon, infinity, rec))
+				{
+					rays.push_back({ r, infinity });
+					break;
+				}
+				rays.push_back({ r, rec.t });
+
+				ray scattered;
+				vec3 attenuation;
+				if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+					break;
+				r = scattered;
+			}
+		}
+	}
+	return rays;
+}
+
+
+class bvh_ray_optimizer
+{
+	public:
+		bvh_ray_optimizer(const std::vector<pilot_ray>& pilot_rays, double t0, double t1)
+			: rays(pilot_rays), time0(t0), time1(t1)
+		{}
+
+		ray_optimization_report optimize(bvh_node& root, int passes);
+
+	private:
+		void find_closest_primitive(const shared_ptr<hittable>& child, const ray& r, double& closest, const hittable*& primitive) const;
+		double replay(const shared_ptr<hittable>& child, uint32_t index, double& closest) const;
+		double replay(const bvh_node& node, uint32_t index) const;
+		double replay(const bvh_node& node, const std::vector<uint32_t>& candidates) const;
+		std::vector<uint32_t> visiting_rays(const aabb& box, const std::vector<uint32_t>& candidates) const;
+		aabb child_box(const shared_ptr<hittable>& child) const;
+		size_t rotate(bvh_node& node, const std::vector<uint32_t>& candidates);
+
+	private:
+		const std::vector<pilot_ray>& rays;
+		std::vector<const hittable*> hit_primitive;		// primitive hit by each pilot ray, nullptr for misses
+		std::vector<double> hit_t;
+		double time0;
+		double time1;
+};
+
+// Interior bvh_nodes can be rotated, leaves (single objects, bvh_nodes without right child) cannot
+inline bvh_node* rotatable_node(const shared_ptr<hittable>& child)
+{
+	auto node = dynamic_cast<bvh_node*>(child.get());
+	return node && node->right ? node : nullptr;
+}
+
+// Primitives of a leaf, expanded the same way linear_bvh flattens them
+template <typename F>
+void for_each_leaf_primitive(const shared_ptr<hittable>& leaf, F&& f)
+{
+	const hittable* object = leaf.get();
+	auto node = dynamic_cast<const bvh_node*>(object);
+	if (node && !node->right)
+		object = node->left.get();
+
+	if (auto list = dynamic_cast<const hittable_list*>(object))
+	{
+		for (const auto& prim : list->objects)
+			f(prim);
+	}
+	else
+	{
+		f(node ? node->left : leaf);
+	}
+}
+
+// Same as bvh_node::hit, but remembers which primitive was hit
+void bvh_ray_optimizer::find_closest_primitive(const shared_ptr<hittable>& child, const ray& r, double& closest, const hittable*& primitive) const
+{
+	if (auto node = rotatable_node(child))
+	{
+		if (!node->box.hit(r, epsilon, closest))
+			return;
+		find_closest_primitive(node->left, r, closest, primitive);
+		find_closest_primitive(node->right, r, closest, primitive);
+		return;
+	}
+
+	for_each_leaf_primitive(child, [&](const shared_ptr<hittable>& prim)
+	{
+		hit_record rec;
+		if (prim->hit(r, epsilon, closest, rec))
+		{
+			closest = rec.t;
+			primitive = prim.get();
+		}
+	});
+}
+
+std::vector<uint32_t> bvh_ray_optimizer::visiting_rays(const aabb& box, const std::vector<uint32_t>& candidates) const
+{
+	std::vector<uint32_t> result;
+	for (uint32_t i : candidates)
+		if (box.hit(rays[i].r, epsilon, hit_t[i]))
+			result.push_back(i);
+	return result;
+}
+
+aabb bvh_ray_optimizer::child_box(const shared_ptr<hittable>& child) const
+{
+	aabb box;
+	if (!child->bounding_box(time0, time1, box))
+		std::cerr << "No bounding box in bvh_ray_optimizer.\n";
+	return box;
+}
+
+/* Cost of pilot ray index in the subtree of child, replaying the traversal of linear_bvh: every node
+   costs a box test, children are visited front to back along the axis their centroids are apart the
+   most, and a leaf costs one intersection per primitive. Once the leaf with the primitive the ray hits
+   is reached, closest drops to the hit distance and prunes the remaining nodes. */
+double bvh_ray_optimizer::replay(const shared_ptr<hittable>& child, uint32_t index, double& closest) const
+{
+	const ray& r = rays[index].r;
+	double cost = sah_traversal_cost;
+
+	if (auto node = rotatable_node(child))
+	{
+		if (!node->box.hit(r, epsilon, closest))
+			return cost;
+
+		const aabb box_left = child_box(node->left);
+		const aabb box_right = child_box(node->right);
+		vec3 d = box_right.centroid() - box_left.centroid();
+		int axis = 0;
+		for (int a = 1; a < 3; ++a)
+			if (std::abs(d[a]) > std::abs(d[axis])) axis = a;
+
+		const bool right_first = r.direction()[axis] < 0;
+		cost += replay(right_first ? node->right : node->left, index, closest);
+		cost += replay(right_first ? node->left : node->right, index, closest);
+		return cost;
+	}
+
+	if (!child_box(child).hit(r, epsilon, closest))
+		return cost;
+
+	for_each_leaf_primitive(child, [&](const shared_ptr<hittable>& prim)
+	{
+		cost += sah_intersection_cost;
+		if (prim.get() == hit_primitive[index])
+			closest = std::min(closest, hit_t[index]);
+	});
+	return cost;
+}
+
+// A ray starts into the subtree without a hit yet, or bounded by a closer hit outside of the tree
+double bvh_ray_optimizer::replay(const bvh_node& node, uint32_t index) const
+{
+	double closest = hit_primitive[index] ? infinity : hit_t[index];
+	const ray& r = rays[index].r;
+	if (!node.box.hit(r, epsilon, closest))
+		return sah_traversal_cost;
+
+	double cost = sah_traversal_cost;
+	if (!node.right)
+	{
+		for_each_leaf_primitive(node.left, [&](const shared_ptr<hittable>&) { cost += sah_intersection_cost; });
+		return cost;
+	}
+
+	const aabb box_left = child_box(node.left);
+	const aabb box_right = child_box(node.right);
+	vec3 d = box_right.centroid() - box_left.centroid();
+	int axis = 0;
+	for (int a = 1; a < 3; ++a)
+		if (std::abs(d[a]) > std::abs(d[axis])) axis = a;
+
+	const bool right_first = r.direction()[axis] < 0;
+	cost += replay(right_first ? node.right : node.left, index, closest);
+	cost += replay(right_first ? node.left : node.right, index, closest);
+	return cost;
+}
+
+double bvh_ray_optimizer::replay(const bvh_node& node, const std::vector<uint32_t>& candidates) const
+{
+	double cost = 0;
+	for (uint32_t i : candidates)
+		cost += replay(node, i);
+	return cost;
+}
+
+/* Greedy top-down pass: At every node, each child may be swapped with a grandchild on the other side.
+   Swapping left with right->left turns right into a node over (left, right->right). Every swap is
+   tried on the rays reaching the node and the cheapest arrangement is kept, then the children are
+   processed with the rays that reach them. */
+size_t bvh_ray_optimizer::rotate(bvh_node& node, const std::vector<uint32_t>& candidates)
+{
+	size_t rotations = 0;
+	if (!node.right)
+		return rotations;
+
+	struct rotation
+	{
+		shared_ptr<hittable>* child;		// child of node that moves down
+		bvh_node* sibling;					// other child of node, gets a new box
+		shared_ptr<hittable>* grandchild;	// child of sibling that moves up
+	};
+
+	const double current_cost = replay(node, candidates);
+	rotation best = {};
+	double best_cost = current_cost;
+
+	auto consider = [&](shared_ptr<hittable>& child, bvh_node* sibling)
+	{
+		if (!sibling)
+			return;
+
+		rotation options[2] = {
+			{ &child, sibling, &sibling->left },
+			{ &child, sibling, &sibling->right } };
+
+		for (const auto& option : options)
+		{
+			// Try the swap, measure, and undo it again
+			const aabb old_box = sibling->box;
+			std::swap(*option.child, *option.grandchild);
+			sibling->box = surrounding_box(child_box(sibling->left), child_box(sibling->right));
+
+			const double cost = replay(node, candidates);
+
+			std::swap(*option.child, *option.grandchild);
+			sibling->box = old_box;
+
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best = option;
+			}
+		}
+	};
+
+	consider(node.left, rotatable_node(node.right));
+	consider(node.right, rotatable_node(node.left));
+
+	if (best.child)
+	{
+		std::swap(*best.child, *best.grandchild);
+		best.sibling->box = surrounding_box(child_box(best.sibling->left), child_box(best.sibling->right));
+		++rotations;
+	}
+
+	for (const auto& child : { node.left, node.right })
+	{
+		if (auto child_node = rotatable_node(child))
+		{
+			rotations += rotate(*child_node, visiting_rays(child_node->box, candidates));
+			child_node->update_sah_cost(child_box(child_node->left), child_box(child_node->right));
+			child_node->build_sah_cost = child_node->sah_cost;
+		}
+	}
+	return rotations;
+}
+
+ray_optimization_report bvh_ray_optimizer::optimize(bvh_node& root, int passes)
+{
+	ray_optimization_report report;
+	report.pilot_rays = rays.size();
+
+	// Closest hit of every pilot ray in this tree, found once. If the ray hit something outside of the
+	// tree first, hit_t is that distance and hit_primitive stays nullptr.
+	hit_primitive.assign(rays.size(), nullptr);
+	hit_t.assign(rays.size(), infinity);
+	std::vector<uint32_t> all(rays.size());
+	for (size_t i = 0; i < rays.size(); ++i)
+	{
+		all[i] = static_cast<uint32_t>(i);
+		if (root.box.hit(rays[i].r, epsilon, infinity))
+		{
+			find_closest_primitive(root.left, rays[i].r, hit_t[i], hit_primitive[i]);
+			if (root.right)
+				find_closest_primitive(root.right, rays[i].r, hit_t[i], hit_primitive[i]);
+		}
+
+		if (rays[i].tmax < hit_t[i])
+		{
+			hit_t[i] = rays[i].tmax;
+			hit_primitive[i] = nullptr;
+		}
+	}
+
+	report.cost_before = replay(root, all);
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		size_t rotations = rotate(root, visiting_rays(root.box, all));
+		report.rotations += rotations;
+		if (rotations == 0)
+			break;
+	}
+
+	if (root.right)
+	{
+		root.update_sah_cost(child_box(root.left), child_box(root.right));
+		root.build_sah_cost = root.sah_cost;
+	}
+	report.cost_after = replay(root, all);
+	return report;
+}
+
+// Rotates root so the pilot rays are traced with fewer box and primitive tests
+ray_optimization_report optimize_bvh_for_rays(bvh_node& root, const std::vector<pilot_ray>& rays, double time0, double time1, int passes = 4)
+{
+	bvh_ray_optimizer optimizer(rays, time0, time1);
+	return optimizer.optimize(root, passes);
+}
@@ -6,10 +6,11 @@
 class camera 
 {
     public:
-        camera() : camera(vec3(0, 0, -1), vec3(0, 0, 0), vec3(0, 1, 0), 40, 1, 0, 10) {}
+        constexpr camera() : camera(vec3(0, 0, -1), vec3(0, 0, 0), vec3(0, 1, 0), 40, 1, 0, 10) {}
 
         // vfov is top to bottom in degrees
-        camera(vec3 lookfrom, vec3 lookat, vec3 vup, double vfov, double aspect, double aperture, double focus_dist,
+        // constexpr, so a camera with fixed parameters gets its basis computed at compile time.
+        constexpr camera(vec3 lookfrom, vec3 lookat, vec3 vup, double vfov, double aspect, double aperture, double focus_dist,
             double t0 = 0, double t1 = 0) 
         {
             origin = lookfrom;
@@ -18,11 +19,11 @@ class camera
             time1 = t1;
 
             double theta = degrees_to_radians(vfov);
-            double half_height = tan(theta/2);
+            double half_height = constexpr_tan(theta/2);
             double half_width = aspect * half_height;
             
-            w = unit_vector(lookfrom - lookat);
-            u = unit_vector(cross(vup, w));
+            w = constexpr_unit_vector(lookfrom - lookat);
+            u = constexpr_unit_vector(cross(vup, w));
             v = cross(w,u);
             lower_left_corner = origin - half_width*focus_dist*u - half_height*focus_dist*v - focus_dist*w;
             horizontal = 2*half_width*focus_dist*u;
@@ -47,6 +48,6 @@ class camera
         vec3 lower_left_corner;
         vec3 horizontal;
         vec3 vertical;
-        double lens_radius;
-        double time0, time1; // shutter open/close times
+        double lens_radius = 0;
+        double time0 = 0, time1 = 0; // shutter open/close times
 };
@@ -0,0 +1,437 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+
+/* Node of a 4-wide BVH with quantized child bounds (Ylitie et al., "Efficient Incoherent Ray
+   Traversal on GPUs Through Compressed Wide BVHs"). Every child coordinate is an 8 bit integer q
+   on a grid over the node's own box: origin + q * 2^exponent. The grid spacing is a power of two,
+   so decoding is one exact multiplication plus one rounded addition. 64 bytes instead of the
+   128 bytes of a qbvh node with float bounds, and a quarter of the 4 * 64 bytes of bvh_nodes with
+   double boxes and shared_ptrs. */
+struct alignas(64) compressed_bvh_node
+{
+	float origin[3];
+	int8_t exponent[3];			// grid spacing per axis is 2^exponent
+	uint8_t child_count;
+	uint8_t qmin[3][4];
+	uint8_t qmax[3][4];
+	uint32_t child[4];			// interior child: node index, leaf child: first primitive
+	uint16_t prim_count[4];		// 0 for interior children
+};
+
+static_assert(sizeof(compressed_bvh_node) == 64, "compressed_bvh_node has to fit a cache line");
+
+// 2^exponent built directly from the float bits, exponent has to be in [-126, 127]
+inline float compressed_scale(int exponent)
+{
+	uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+	float scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return scale;
+}
+
+// The same float operations as the traversal, so the rounding checked when quantizing is the rounding used there
+inline float dequantize(float origin, float scale, int q)
+{
+	return origin + static_cast<float>(q) * scale;
+}
+
+/* Sets the quantized bounds of the count children of node. Rounding is conservative: lower bounds
+   are rounded down and upper bounds up, and the decoded float values are checked against the double
+   boxes, so the quantized box always contains the exact one and no hit is lost. The spacing of an
+   axis is the smallest power of two whose grid of 255 steps still reaches the largest child bound. */
+void set_compressed_bounds(compressed_bvh_node& node, const aabb child_boxes[4], int count)
+{
+	node.child_count = static_cast<uint8_t>(count);
+	std::memset(node.qmin, 0, sizeof(node.qmin));
+	std::memset(node.qmax, 0, sizeof(node.qmax));
+
+	for (int a = 0; a < 3; ++a)
+	{
+		double lo = infinity;
+		double hi = -infinity;
+		for (int i = 0; i < count; ++i)
+		{
+			lo = std::min(lo, child_boxes[i].min()[a]);
+			hi = std::max(hi, child_boxes[i].max()[a]);
+		}
+
+		const float origin = round_down(lo);
+		const double extent = round_up(hi) - static_cast<double>(origin);
+
+		int exponent = -126;
+		if (extent > 0)
+		{
+			int e;
+			std::frexp(extent / 255, &e);
+			exponent = std::max(e - 1, -126);
+		}
+
+		for (;; ++exponent)
+		{
+			const float scale = compressed_scale(exponent);
+			bool fits = true;
+			for (int i = 0; i < count && fits; ++i)
+			{
+				int qlo = static_cast<int>(std::floor((child_boxes[i].min()[a] - origin) / scale));
+				qlo = std::max(qlo, 0);
+				while (qlo > 0 && dequantize(origin, scale, qlo) > child_boxes[i].min()[a])
+					--qlo;
+
+				int qhi = static_cast<int>(std::ceil((child_boxes[i].max()[a] - origin) / scale));
+				qhi = std::max(qhi, qlo);
+				while (qhi <= 255 && dequantize(origin, scale, qhi) < child_boxes[i].max()[a])
+					++qhi;
+
+				if (qhi > 255)
+				{
+					fits = false;
+					break;
+				}
+				node.qmin[a][i] = static_cast<uint8_t>(qlo);
+				node.qmax[a][i] = static_cast<uint8_t>(qhi);
+			}
+			if (fits)
+			{
+				node.origin[a] = origin;
+				node.exponent[a] = static_cast<int8_t>(exponent);
+				break;
+			}
+		}
+	}
+}
+
+// Decoded bounds of all children, as structure of arrays like wide_bvh_node
+inline void decode_compressed_bounds(const compressed_bvh_node& node, float bounds_min[3][4], float bounds_max[3][4])
+{
+	for (int a = 0; a < 3; ++a)
+	{
+		const float scale = compressed_scale(node.exponent[a]);
+		for (int i = 0; i < 4; ++i)
+		{
+			bounds_min[a][i] = dequantize(node.origin[a], scale, node.qmin[a][i]);
+			bounds_max[a][i] = dequantize(node.origin[a], scale, node.qmax[a][i]);
+		}
+	}
+}
+
+// Box of the whole node, i.e. of all its children
+aabb compressed_node_box(const compressed_bvh_node& node)
+{
+	float bounds_min[3][4];
+	float bounds_max[3][4];
+	decode_compressed_bounds(node, bounds_min, bounds_max);
+
+	vec3 lo(infinity, infinity, infinity);
+	vec3 hi(-infinity, -infinity, -infinity);
+	for (int i = 0; i < node.child_count; ++i)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			lo[a] = std::min(lo[a], static_cast<double>(bounds_min[a][i]));
+			hi[a] = std::max(hi[a], static_cast<double>(bounds_max[a][i]));
+		}
+	}
+	return aabb(lo, hi);
+}
+
+// Bit mask of the children hit by the ray, same as wide_node_hit after decoding the bounds
+inline int compressed_node_hit(const compressed_bvh_node& node, const wide_bvh_ray& r, float tmin, float tmax, float tnear[4])
+{
+#ifdef WIDE_BVH_SSE
+	__m128 tn = _mm_set1_ps(tmin);
+	__m128 tf = _mm_set1_ps(tmax);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (int a = 0; a < 3; ++a)
+	{
+		// 4 bytes to 4 floats
+		int32_t packed_min;
+		int32_t packed_max;
+		std::memcpy(&packed_min, node.qmin[a], sizeof(packed_min));
+		std::memcpy(&packed_max, node.qmax[a], sizeof(packed_max));
+		const __m128 qmin = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_min), zero), zero));
+		const __m128 qmax = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed_max), zero), zero));
+
+		const __m128 origin = _mm_set1_ps(node.origin[a]);
+		const __m128 scale = _mm_set1_ps(compressed_scale(node.exponent[a]));
+		const __m128 bmin = _mm_add_ps(origin, _mm_mul_ps(qmin, scale));
+		const __m128 bmax = _mm_add_ps(origin, _mm_mul_ps(qmax, scale));
+
+		const __m128 o = _mm_set1_ps(r.origin[a]);
+		const __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+		const __m128 near_plane = r.dir_is_neg[a] ? bmax : bmin;
+		const __m128 far_plane = r.dir_is_neg[a] ? bmin : bmax;
+		tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, o), inv), tn);
+		tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv), tf);
+	}
+
+	_mm_storeu_ps(tnear, tn);
+	int mask = _mm_movemask_ps(_mm_cmplt_ps(tn, _mm_mul_ps(tf, _mm_set1_ps(wide_bvh_robust_scale))));
+	return mask & ((1 << node.child_count) - 1);
+#else
+	float bounds_min[3][4];
+	float bounds_max[3][4];
+	decode_compressed_bounds(node, bounds_min, bounds_max);
+
+	float tfar[4];
+	for (int i = 0; i < 4; ++i)
+	{
+		tnear[i] = tmin;
+		tfar[i] = tmax;
+	}
+
+	for (int a = 0; a < 3; ++a)
+	{
+		const float* near_plane = r.dir_is_neg[a] ? bounds_max[a] : bounds_min[a];
+		const float* far_plane = r.dir_is_neg[a] ? bounds_min[a] : bounds_max[a];
+		for (int i = 0; i < 4; ++i)
+		{
+			float t0 = (near_plane[i] - r.origin[a]) * r.inv_dir[a];
+			float t1 = (far_plane[i] - r.origin[a]) * r.inv_dir[a];
+			tnear[i] = t0 > tnear[i] ? t0 : tnear[i];
+			tfar[i] = t1 < tfar[i] ? t1 : tfar[i];
+		}
+	}
+
+	int mask = 0;
+	for (int i = 0; i < node.child_count; ++i)
+		if (tnear[i] < tfar[i] * wide_bvh_robust_scale)
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+
+/* qbvh with quantized nodes for scenes whose BVH would not fit into memory otherwise. The topology
+   and primitive order are taken from a qbvh, only the child bounds are stored with 8 bits each.
+   The quantized boxes are slightly larger than the exact ones, so rays visit a few more nodes, but
+   twice as many nodes fit into every cache level. */
+class compressed_bvh : public hittable
+{
+	public:
+		compressed_bvh(hittable_list& list, double time0, double time1)
+			: compressed_bvh(qbvh(list, time0, time1))
+		{}
+
+		explicit compressed_bvh(const qbvh& wide);
+
+		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, tmin, tmax, rec);
+		}
+
+		virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = box;
+			return true;
+		}
+
+		virtual bool occluded(const ray& r, double tmin, double tmax) const;
+
+		// Quantizes all nodes again after primitives moved, children before parents
+		virtual void refit(double time0, double time1);
+
+		// Bytes of the nodes and primitive references, without the primitives themselves
+		size_t memory_bytes() const
+		{
+			return nodes.size() * sizeof(compressed_bvh_node) + primitives.size() * sizeof(shared_ptr<hittable>);
+		}
+
+	public:
+		std::vector<compressed_bvh_node> nodes;
+		std::vector<shared_ptr<hittable>> primitives;
+		aabb box;
+};
+
+compressed_bvh::compressed_bvh(const qbvh& wide)
+	: primitives(wide.primitives), box(wide.box)
+{
+	nodes.resize(wide.nodes.size());
+	for (size_t n = 0; n < wide.nodes.size(); ++n)
+	{
+		const wide_bvh_node<4>& source = wide.nodes[n];
+		compressed_bvh_node& node = nodes[n];
+
+		aabb child_boxes[4];
+		for (int i = 0; i < source.child_count; ++i)
+		{
+			child_boxes[i] = aabb(
+				vec3(source.bounds_min[0][i], source.bounds_min[1][i], source.bounds_min[2][i]),
+				vec3(source.bounds_max[0][i], source.bounds_max[1][i], source.bounds_max[2][i]));
+			node.child[i] = source.child[i];
+			node.prim_count[i] = source.prim_count[i];
+		}
+		set_compressed_bounds(node, child_boxes, source.child_count);
+	}
+}
+
+void compressed_bvh::refit(double time0, double time1)
+{
+	refit_objects(primitives, time0, time1);
+
+	// Exact boxes of the nodes, so the error of quantizing does not add up towards the root
+	std::vector<aabb> node_boxes(nodes.size());
+
+	// Child nodes are always created after their parent, so a backwards pass sees them first
+	for (size_t n = nodes.size(); n-- > 0;)
+	{
+		compressed_bvh_node& node = nodes[n];
+		aabb child_boxes[4];
+		for (int i = 0; i < node.child_count; ++i)
+		{
+			if (node.prim_count[i] == 0)
+			{
+				child_boxes[i] = node_boxes[node.child[i]];
+				continue;
+			}
+
+			for (uint32_t p = node.child[i]; p < node.child[i] + node.prim_count[i]; ++p)
+			{
+				aabb prim_box;
+				if (!primitives[p]->bounding_box(time0, time1, prim_box))
+					std::cerr << "No bounding box in compressed_bvh::refit.\n";
+				if (p == node.child[i])
+					child_boxes[i] = prim_box;
+				else
+					child_boxes[i].expand(prim_box);
+			}
+		}
+
+		set_compressed_bounds(node, child_boxes, node.child_count);
+		node_boxes[n] = child_boxes[0];
+		for (int i = 1; i < node.child_count; ++i)
+			node_boxes[n].expand(child_boxes[i]);
+	}
+
+	if (!nodes.empty())
+		box = node_boxes[0];
+}
+
+bool compressed_bvh::intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const
+{
+	wide_bvh_ray wr;
+	for (int a = 0; a < 3; ++a)
+	{
+		wr.origin[a] = static_cast<float>(r.origin()[a]);
+		wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+		wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+	}
+
+	struct stack_entry
+	{
+		uint32_t index;
+		uint16_t prim_count;
+		float tnear;
+	};
+
+	stack_entry stack[linear_bvh_max_depth * 3 + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, -std::numeric_limits<float>::infinity() };
+
+	const float ftmin = round_down(tmin);
+	double closest = tmax;
+	bool hit_anything = false;
+
+	while (stack_size > 0)
+	{
+		const stack_entry entry = stack[--stack_size];
+		if (entry.tnear > closest)
+			continue;
+
+		if (entry.prim_count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + entry.prim_count; ++i)
+			{
+				if (primitives[i]->intersect(r, tmin, closest, candidate, rec))
+				{
+					hit_anything = true;
+					closest = candidate.t;
+				}
+			}
+			continue;
+		}
+
+		const compressed_bvh_node& node = nodes[entry.index];
+		float tnear[4];
+		int mask = compressed_node_hit(node, wr, ftmin, round_up(closest), tnear);
+
+		// Nearest hit child on top of the stack, as in wide_bvh
+		int first = stack_size;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			stack_entry child = { node.child[i], node.prim_count[i], tnear[i] };
+			int j = stack_size++;
+			while (j > first && stack[j - 1].tnear < child.tnear)
+			{
+				stack[j] = stack[j - 1];
+				--j;
+			}
+			stack[j] = child;
+		}
+	}
+
+	return hit_anything;
+}
+
+// Any hit: children are pushed unsorted and the first blocking primitive ends the traversal
+bool compressed_bvh::occluded(const ray& r, double tmin, double tmax) const
+{
+	wide_bvh_ray wr;
+	for (int a = 0; a < 3; ++a)
+	{
+		wr.origin[a] = static_cast<float>(r.origin()[a]);
+		wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+		wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+	}
+
+	struct stack_entry
+	{
+		uint32_t index;
+		uint16_t prim_count;
+	};
+
+	stack_entry stack[linear_bvh_max_depth * 3 + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0 };
+
+	const float ftmin = round_down(tmin);
+	const float ftmax = round_up(tmax);
+
+	while (stack_size > 0)
+	{
+		const stack_entry entry = stack[--stack_size];
+
+		if (entry.prim_count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + entry.prim_count; ++i)
+				if (primitives[i]->occluded(r, tmin, tmax))
+					return true;
+			continue;
+		}
+
+		const compressed_bvh_node& node = nodes[entry.index];
+		float tnear[4];
+		int mask = compressed_node_hit(node, wr, ftmin, ftmax, tnear);
+		for (int i = 0; i < 4; ++i)
+			if (mask & (1 << i))
+				stack[stack_size++] = { node.child[i], node.prim_count[i] };
+	}
+
+	return false;
+}
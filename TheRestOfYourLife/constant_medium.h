@@ -14,49 +14,66 @@ class constant_medium : public hittable
 			phase_function = make_shared<isotropic>(a);
 		}
 
-		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
+
+		// Samples the scattering distance like hit, the record is only filled for hit
+		virtual bool occluded(const ray& r, double t_min, double t_max) const
+		{
+			double t;
+			return sample_scattering(r, t_min, t_max, t);
+		}
 
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
 		{
 			return boundary->bounding_box(time0, time1, output_box);
 		}
 
+		virtual void refit(double time0, double time1)
+		{
+			boundary->refit(time0, time1);
+		}
+
+	private:
+		// Picks the t where the ray scatters inside the boundary, false if it passes through
+		bool sample_scattering(const ray& r, double t_min, double t_max, double& t) const;
+
 	private:
 		shared_ptr<hittable> boundary;
 		shared_ptr<material> phase_function;
 		double neg_inv_density;
 };
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool constant_medium::sample_scattering(const ray& r, double t_min, double t_max, double& t) const
 {
 	// Print occasional samples when debugging. To enable, set enableDebug true.
 	const bool enableDebug = false;
 	const bool debugging = enableDebug && random_double() < 0.00001;
 
-	hit_record rec1;
-	hit_record rec2;
-
-	// Test if medium was hit at all (entry point)
-	if (!boundary->hit(r, -infinity, infinity, rec1))
-		return false;
-
-	// Test if ray also exited the medium once it hit
-	if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2))
+	// Entry and exit of the boundary in one query, spheres and boxes get both from a single test
+	double t_enter;
+	double t_exit;
+	if (!boundary->hit_interval(r, t_enter, t_exit))
 		return false;
 
-	if (debugging) std::cerr << '\nt0=' << rec1.t << ", t1=" << rec2.t << '\n';
+	if (debugging) std::cerr << '\nt0=' << t_enter << ", t1=" << t_exit << '\n';
 
-	if (rec1.t < t_min) rec1.t = t_min;
-	if (rec2.t > t_max) rec2.t = t_max;
+	if (t_enter < t_min) t_enter = t_min;
+	if (t_exit > t_max) t_exit = t_max;
 
-	if (rec1.t >= rec2.t)
+	if (t_enter >= t_exit)
 		return false;
 
-	if (rec1.t < 0)
-		rec1.t = 0;
+	if (t_enter < 0)
+		t_enter = 0;
 
 	const auto ray_length = r.direction().length();
-	const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+	const auto distance_inside_boundary = (t_exit - t_enter) * ray_length;
 
 	/* Rays may scatter at any point. The denser the volume, the more likely that is. The probability
 	   is proportional to the optical density of the volume. Compute the distance (where scattering occurs)
@@ -66,19 +83,34 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 	if (hit_distance > distance_inside_boundary) // ... If that distance is outside the volume, then there is no hit
 		return false;
 
-	rec.t = rec1.t + hit_distance / ray_length;
-	rec.p = r.at(rec.t);
+	t = t_enter + hit_distance / ray_length;
 
 	if (debugging)
 	{
 		std::cerr	<< "hit_distance = " << hit_distance << '\n'
-					<< "rec.t = " << rec.t << '\n'
-					<< "rec.p = " << rec.p << '\n';
+					<< "t = " << t << '\n'
+					<< "p = " << r.at(t) << '\n';
 	}
 
+	return true;
+}
+
+bool constant_medium::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	double t;
+	if (!sample_scattering(r, t_min, t_max, t))
+		return false;
+
+	candidate.t = t;
+	candidate.object = this;
+	return true;
+}
+
+void constant_medium::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+	rec.t = candidate.t;
+	rec.p = r.at(rec.t);
 	rec.normal = vec3(1, 0, 0); // arbitrary
 	rec.front_face = true;		// also arbitrary
 	rec.mat_ptr = phase_function;
-
-	return true;
 }
@@ -0,0 +1,374 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "texture.h"
+#include "material.h"
+#include "perlin.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <ppl.h>
+#include <vector>
+
+
+// Voxels per brick edge. A brick is also one cell of the majorant grid.
+const int density_brick_size = 8;
+const int density_brick_voxels = density_brick_size * density_brick_size * density_brick_size;
+
+
+/* Voxel densities, stored in bricks of 8x8x8 voxels. Only bricks with a non-zero voxel are
+   allocated, so empty space around a cloud costs one index per brick, a dense volume simply has all
+   bricks. For every brick the largest density interpolation can reach inside it is kept: the coarse
+   majorant grid delta and ratio tracking step through. */
+class density_grid
+{
+	public:
+		// nx * ny * nz voxels, density(i, j, k) gives the density of each of them
+		density_grid(int nx, int ny, int nz, const std::function<double(int, int, int)>& density);
+
+		// Trilinearly interpolated density at grid coordinates g, voxel (i, j, k) is the unit cube at (i, j, k)
+		double lookup(const vec3& g) const;
+
+		double majorant(int bx, int by, int bz) const { return majorants[brick(bx, by, bz)]; }
+
+		int voxel_count(int axis) const { return voxels[axis]; }
+		int brick_count(int axis) const { return bricks[axis]; }
+
+		size_t allocated_bricks() const { return brick_data.size() / density_brick_voxels; }
+
+		size_t memory_bytes() const
+		{
+			return brick_index.size() * sizeof(int32_t) + brick_data.size() * sizeof(float) + majorants.size() * sizeof(float);
+		}
+
+	private:
+		size_t brick(int bx, int by, int bz) const
+		{
+			return (static_cast<size_t>(bz) * bricks[1] + by) * bricks[0] + bx;
+		}
+
+		// Density of a voxel, indices are clamped to the grid
+		float voxel(int i, int j, int k) const;
+
+	private:
+		int voxels[3];
+		int bricks[3];
+		std::vector<int32_t> brick_index;	// Start of each brick in brick_data / density_brick_voxels, -1 for empty bricks
+		std::vector<float> brick_data;
+		std::vector<float> majorants;
+};
+
+density_grid::density_grid(int nx, int ny, int nz, const std::function<double(int, int, int)>& density)
+	: voxels{ nx, ny, nz }
+{
+	for (int a = 0; a < 3; ++a)
+		bricks[a] = (voxels[a] + density_brick_size - 1) / density_brick_size;
+
+	const size_t count = static_cast<size_t>(bricks[0]) * bricks[1] * bricks[2];
+
+	// Bricks are filled in parallel, empty ones are dropped when they are packed afterwards
+	std::vector<float> dense(count * density_brick_voxels, 0.0f);
+	std::vector<char> empty(count, 1);
+	concurrency::parallel_for(size_t(0), count, [&](size_t b)
+	{
+		const int bx = static_cast<int>(b % bricks[0]);
+		const int by = static_cast<int>(b / bricks[0] % bricks[1]);
+		const int bz = static_cast<int>(b / bricks[0] / bricks[1]);
+		float* values = &dense[b * density_brick_voxels];
+		for (int k = 0; k < density_brick_size; ++k)
+		{
+			for (int j = 0; j < density_brick_size; ++j)
+			{
+				for (int i = 0; i < density_brick_size; ++i)
+				{
+					const int x = bx * density_brick_size + i;
+					const int y = by * density_brick_size + j;
+					const int z = bz * density_brick_size + k;
+					if (x >= nx || y >= ny || z >= nz)
+						continue;
+
+					const float d = static_cast<float>(std::max(0.0, density(x, y, z)));
+					values[(k * density_brick_size + j) * density_brick_size + i] = d;
+					if (d > 0)
+						empty[b] = 0;
+				}
+			}
+		}
+	});
+
+	brick_index.assign(count, -1);
+	for (size_t b = 0; b < count; ++b)
+	{
+		if (empty[b])
+			continue;
+		brick_index[b] = static_cast<int32_t>(brick_data.size() / density_brick_voxels);
+		brick_data.insert(brick_data.end(), dense.begin() + b * density_brick_voxels, dense.begin() + (b + 1) * density_brick_voxels);
+	}
+
+	// Interpolation inside a brick also reads the neighbouring voxels one step outside of it
+	majorants.assign(count, 0.0f);
+	concurrency::parallel_for(size_t(0), count, [&](size_t b)
+	{
+		const int bx = static_cast<int>(b % bricks[0]);
+		const int by = static_cast<int>(b / bricks[0] % bricks[1]);
+		const int bz = static_cast<int>(b / bricks[0] / bricks[1]);
+		float max_density = 0;
+		for (int z = bz * density_brick_size - 1; z <= (bz + 1) * density_brick_size; ++z)
+			for (int y = by * density_brick_size - 1; y <= (by + 1) * density_brick_size; ++y)
+				for (int x = bx * density_brick_size - 1; x <= (bx + 1) * density_brick_size; ++x)
+					max_density = std::max(max_density, voxel(x, y, z));
+		majorants[b] = max_density;
+	});
+}
+
+float density_grid::voxel(int i, int j, int k) const
+{
+	i = std::clamp(i, 0, voxels[0] - 1);
+	j = std::clamp(j, 0, voxels[1] - 1);
+	k = std::clamp(k, 0, voxels[2] - 1);
+
+	const int32_t index = brick_index[brick(i / density_brick_size, j / density_brick_size, k / density_brick_size)];
+	if (index < 0)
+		return 0;
+
+	const int x = i % density_brick_size;
+	const int y = j % density_brick_size;
+	const int z = k % density_brick_size;
+	return brick_data[static_cast<size_t>(index) * density_brick_voxels + (z * density_brick_size + y) * density_brick_size + x];
+}
+
+// Values sit at the voxel centers, so the interpolation cell starts half a voxel further down
+double density_grid::lookup(const vec3& g) const
+{
+	const double x = g.x() - 0.5;
+	const double y = g.y() - 0.5;
+	const double z = g.z() - 0.5;
+	const int i = static_cast<int>(std::floor(x));
+	const int j = static_cast<int>(std::floor(y));
+	const int k = static_cast<int>(std::floor(z));
+
+	double c[2][2][2];
+	for (int di = 0; di < 2; ++di)
+		for (int dj = 0; dj < 2; ++dj)
+			for (int dk = 0; dk < 2; ++dk)
+				c[di][dj][dk] = voxel(i + di, j + dj, k + dk);
+
+	return trilinear_interp(c, x - i, y - j, z - k);
+}
+
+
+/* Heterogeneous medium: the densities of a density_grid stretched over a box. Free flights are
+   sampled with delta tracking and shadow transmittance is estimated with ratio tracking (Novak et
+   al. 2014), both against the brick majorants. The ray steps through the bricks with a 3D DDA:
+   empty bricks are skipped without a single sample, and in the others the tentative collisions are
+   only as dense as the brick's own maximum demands. */
+class grid_medium : public hittable
+{
+	public:
+		// density_scale turns grid values into densities per unit length in world space
+		grid_medium(shared_ptr<density_grid> g, const aabb& volume, double density_scale, shared_ptr<texture> a);
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
+
+		// Blocked with probability 1 - transmittance, so the expected visibility is the same
+		virtual bool occluded(const ray& r, double t_min, double t_max) const
+		{
+			return random_double() >= transmittance(r, t_min, t_max);
+		}
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = bounds;
+			return true;
+		}
+
+		// Unbiased estimate of the fraction of light passing the medium between t_min and t_max
+		double transmittance(const ray& r, double t_min, double t_max) const;
+
+	private:
+		// Visits the tentative collisions along the ray, sampled against the majorant of the brick they
+		// fall into. collision(t, density / majorant) returns true to stop, track() then returns true.
+		template <typename Collision>
+		bool track(const ray& r, double t_min, double t_max, Collision&& collision) const;
+
+	private:
+		shared_ptr<density_grid> grid;
+		aabb bounds;
+		vec3 voxel_scale;	// Grid coordinates per world unit
+		double density_scale;
+		shared_ptr<material> phase_function;
+};
+
+grid_medium::grid_medium(shared_ptr<density_grid> g, const aabb& volume, double scale, shared_ptr<texture> a)
+	: grid(g), bounds(volume), density_scale(scale)
+{
+	for (int axis = 0; axis < 3; ++axis)
+		voxel_scale[axis] = grid->voxel_count(axis) / (bounds.max()[axis] - bounds.min()[axis]);
+	phase_function = make_shared<isotropic>(a);
+}
+
+// The ray is moved to grid coordinates without normalizing it, so t is the same in both spaces
+template <typename Collision>
+bool grid_medium::track(const ray& r, double t_min, double t_max, Collision&& collision) const
+{
+	const vec3 origin = (r.origin() - bounds.min()) * voxel_scale;
+	const vec3 direction = r.direction() * voxel_scale;
+
+	// Clip the ray to the grid
+	double t0 = t_min;
+	double t1 = t_max;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const double size = grid->voxel_count(axis);
+		if (direction[axis] == 0)
+		{
+			if (origin[axis] < 0 || origin[axis] > size)
+				return false;
+			continue;
+		}
+
+		double ta = -origin[axis] / direction[axis];
+		double tb = (size - origin[axis]) / direction[axis];
+		if (ta > tb)
+			std::swap(ta, tb);
+		t0 = std::max(t0, ta);
+		t1 = std::min(t1, tb);
+	}
+	if (t0 >= t1)
+		return false;
+
+	// Densities are per world unit, the majorant per unit of t
+	const double per_t = density_scale * r.direction().length();
+
+	// 3D DDA over the bricks (Amanatides, Woo)
+	const vec3 start = origin + t0 * direction;
+	int cell[3];
+	int step[3];
+	double t_next[3];
+	double t_delta[3];
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		cell[axis] = std::clamp(static_cast<int>(std::floor(start[axis] / density_brick_size)), 0, grid->brick_count(axis) - 1);
+		if (direction[axis] > 0)
+		{
+			step[axis] = 1;
+			t_next[axis] = t0 + ((cell[axis] + 1) * density_brick_size - start[axis]) / direction[axis];
+			t_delta[axis] = density_brick_size / direction[axis];
+		}
+		else if (direction[axis] < 0)
+		{
+			step[axis] = -1;
+			t_next[axis] = t0 + (cell[axis] * density_brick_size - start[axis]) / direction[axis];
+			t_delta[axis] = -density_brick_size / direction[axis];
+		}
+		else
+		{
+			step[axis] = 0;
+			t_next[axis] = infinity;
+			t_delta[axis] = infinity;
+		}
+	}
+
+	double t = t0;
+	for (;;)
+	{
+		int axis = 0;
+		if (t_next[1] < t_next[axis]) axis = 1;
+		if (t_next[2] < t_next[axis]) axis = 2;
+		const double cell_exit = std::min(t_next[axis], t1);
+
+		const double majorant = grid->majorant(cell[0], cell[1], cell[2]) * per_t;
+		if (majorant > 0)
+		{
+			for (;;)
+			{
+				t -= std::log(1 - random_double()) / majorant;
+				if (t >= cell_exit)
+					break;
+				if (collision(t, grid->lookup(origin + t * direction) * per_t / majorant))
+					return true;
+			}
+		}
+
+		// Exponential distances have no memory, so sampling restarts at the next brick with its majorant
+		if (t_next[axis] >= t1)
+			return false;
+		t = t_next[axis];
+		cell[axis] += step[axis];
+		if (cell[axis] < 0 || cell[axis] >= grid->brick_count(axis))
+			return false;
+		t_next[axis] += t_delta[axis];
+	}
+}
+
+// Delta tracking: a tentative collision is real with probability density / majorant
+bool grid_medium::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	double t_hit = 0;
+	const bool scattered = track(r, t_min, t_max, [&](double t, double ratio)
+	{
+		if (random_double() >= ratio)
+			return false;
+		t_hit = t;
+		return true;
+	});
+	if (!scattered)
+		return false;
+
+	candidate.t = t_hit;
+	candidate.object = this;
+	return true;
+}
+
+void grid_medium::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+	rec.t = candidate.t;
+	rec.p = r.at(rec.t);
+	rec.normal = vec3(1, 0, 0); // arbitrary
+	rec.front_face = true;		// also arbitrary
+	rec.mat_ptr = phase_function;
+}
+
+// Ratio tracking: every tentative collision scales the transmittance by the chance of it being a null
+// collision. Once the estimate is small, Russian roulette ends the walk without bias.
+double grid_medium::transmittance(const ray& r, double t_min, double t_max) const
+{
+	double result = 1;
+	track(r, t_min, t_max, [&](double t, double ratio)
+	{
+		result *= 1 - ratio;
+		if (result < 0.1)
+		{
+			if (random_double() < 0.5)
+			{
+				result = 0;
+				return true;
+			}
+			result *= 2;
+		}
+		return false;
+	});
+	return result;
+}
+
+
+// Density grid from Perlin turbulence, e.g. for clouds: turbulence at voxel * frequency above
+// threshold, times falloff(i, j, k) to give the volume its shape
+shared_ptr<density_grid> make_noise_density_grid(int nx, int ny, int nz, double frequency, double threshold,
+	const std::function<double(int, int, int)>& falloff)
+{
+	perlin noise;
+	return make_shared<density_grid>(nx, ny, nz, [&](int i, int j, int k)
+	{
+		const double turbulence = noise.turb(frequency * vec3(i, j, k));
+		return std::max(0.0, turbulence - threshold) * falloff(i, j, k);
+	});
+}
@@ -3,6 +3,8 @@
 #include "rtweekend.h"
 #include "aabb.h"
 
+#include <cstdint>
+
 
 class material;
 
@@ -39,16 +41,94 @@ struct hit_record
     }
 };
 
+class hittable;
+
+/* Result of the cheap first phase of a closest hit query: only the distance and the primitive that was hit.
+   Point, normal, uv and material are computed in the second phase (surface_interaction), once for the
+   closest candidate instead of for every closer hit found on the way. */
+struct hit_candidate
+{
+    double t;
+    const hittable* object; // fills the hit_record in surface_interaction(), nullptr if the record is already filled
+    uint32_t index; // part of object that was hit (sphere of a sphere_set, triangle of a mesh)
+    double u; // object specific coordinates of the hit (barycentrics of a triangle)
+    double v;
+};
+
 class hittable
 {
     public:
         // Only hits in the interval [t_min, t_max] are considered. t being the t from ray equation p(t) = orig + t*direction
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
 
+        // First phase of hit(): finds the closest hit in [t_min, t_max] and only stores t and the primitive in candidate.
+        // Objects without a split of the two phases fill rec right away. That only happens for a hit closer than all
+        // candidates before, so rec belongs to the closest hit whenever candidate.object is nullptr.
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+        {
+            if (!hit(r, t_min, t_max, rec))
+                return false;
+
+            candidate.t = rec.t;
+            candidate.object = nullptr;
+            return true;
+        }
+
+        // Second phase: fills rec for a candidate this object returned from intersect() for the same ray
+        virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const {}
+
         // Compute bounding box of object. Object may move in interval time0 und time1, so aabb is calculated to bound all possible locations.
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // Any hit query for shadow rays and ambient occlusion: true if anything is hit in [t_min, t_max].
+        // Returns at the first hit found and fills no hit_record. Objects without a faster test fall back to hit().
+        virtual bool occluded(const ray& r, double t_min, double t_max) const
+        {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec);
+        }
+
+        // Distances where the ray enters and leaves a closed object (media use it for their boundary).
+        // The default takes two closest hit queries, the second one starting just behind the entry.
+        // Convex objects override it with a single test that gives both distances.
+        virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const
+        {
+            hit_candidate entry;
+            hit_candidate exit;
+            hit_record unused;
+            if (!intersect(r, -infinity, infinity, entry, unused))
+                return false;
+            if (!intersect(r, entry.t + 0.0001, infinity, exit, unused))
+                return false;
+
+            t_enter = entry.t;
+            t_exit = exit.t;
+            return true;
+        }
+
+        // Objects that cache the bounds of their children (BVHs, rotate_y, ...) recompute them here after
+        // the children moved or their transforms changed. Plain primitives have nothing to update.
+        virtual void refit(double time0, double time1) {}
 };
 
+// Second phase for whatever intersect() found, nothing to do if the record was filled already
+inline void resolve_hit(const ray& r, const hit_candidate& candidate, hit_record& rec)
+{
+    if (candidate.object)
+        candidate.object->surface_interaction(r, candidate, rec);
+}
+
+// Both phases, hit() of objects that implement intersect()
+inline bool hit_deferred(const hittable& object, const ray& r, double t_min, double t_max, hit_record& rec)
+{
+    hit_candidate candidate;
+    if (!object.intersect(r, t_min, t_max, candidate, rec))
+        return false;
+
+    resolve_hit(r, candidate, rec);
+    return true;
+}
+
 class flip_face : public hittable
 {
     public:
@@ -64,10 +144,50 @@ class flip_face : public hittable
             return true;
         }
 
+        // A candidate of the wrapped primitive stays deferred and is flipped in surface_interaction().
+        // Anything else (ptr is a list) is resolved here, as the flip has to follow it.
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+        {
+            if (!ptr->intersect(r, t_min, t_max, candidate, rec))
+                return false;
+
+            if (candidate.object == ptr.get())
+            {
+                candidate.object = this;
+                return true;
+            }
+
+            resolve_hit(r, candidate, rec);
+            candidate.object = nullptr;
+            rec.front_face = !rec.front_face;
+            return true;
+        }
+
+        virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+        {
+            ptr->surface_interaction(r, candidate, rec);
+            rec.front_face = !rec.front_face;
+        }
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const
+        {
+            return ptr->occluded(r, t_min, t_max);
+        }
+
+        virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const
+        {
+            return ptr->hit_interval(r, t_enter, t_exit);
+        }
+
         virtual bool bounding_box(double t0, double t1, aabb& output_box) const
         {
             return ptr->bounding_box(t0, t1, output_box);
         }
+
+        virtual void refit(double t0, double t1)
+        {
+            ptr->refit(t0, t1);
+        }
         
     private:
         shared_ptr<hittable> ptr;
@@ -84,6 +204,27 @@ class translate : public hittable
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const
+        {
+            return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+        }
+
+        virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const
+        {
+            return ptr->hit_interval(ray(r.origin() - offset, r.direction(), r.time()), t_enter, t_exit);
+        }
+
+        virtual void refit(double time0, double time1)
+        {
+            ptr->refit(time0, time1);
+        }
+
+        // Moves the object, e.g. between frames of an animation. The box is computed on demand, so nothing else to update.
+        void set_offset(const vec3& displacement) { offset = displacement; }
+
+        shared_ptr<hittable> object() const { return ptr; }
+        vec3 displacement() const { return offset; }
+
 
     private:
         shared_ptr<hittable> ptr;
@@ -114,10 +255,28 @@ bool translate::bounding_box(double time0, double time1, aabb& output_box) const
 }
 
 
+// Sine and cosine of a rotation around the y axis. make_y_rotation() is constexpr, so for fixed
+// angles (e.g. the Cornell boxes) no trigonometry is left to do when the scene is built.
+struct y_rotation
+{
+    double sin_theta;
+    double cos_theta;
+};
+
+constexpr y_rotation make_y_rotation(double angle)
+{
+    return { constexpr_sin(degrees_to_radians(angle)), constexpr_cos(degrees_to_radians(angle)) };
+}
+
+
 class rotate_y : public hittable
 {
     public:
-        rotate_y(shared_ptr<hittable> p, double angle);
+        rotate_y(shared_ptr<hittable> p, double angle)
+            : rotate_y(p, y_rotation{ sin(degrees_to_radians(angle)), cos(degrees_to_radians(angle)) })
+        {}
+
+        rotate_y(shared_ptr<hittable> p, const y_rotation& rotation);
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const
@@ -126,6 +285,40 @@ class rotate_y : public hittable
             return hasBox;
         }
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const
+        {
+            return ptr->occluded(rotate_ray(r), t_min, t_max);
+        }
+
+        virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const
+        {
+            return ptr->hit_interval(rotate_ray(r), t_enter, t_exit);
+        }
+
+        virtual void refit(double time0, double time1)
+        {
+            ptr->refit(time0, time1);
+            update_box(time0, time1);
+        }
+
+        // Changes the rotation, e.g. between frames of an animation
+        void set_angle(double angle)
+        {
+            sin_theta = sin(degrees_to_radians(angle));
+            cos_theta = cos(degrees_to_radians(angle));
+            update_box(0, 1);
+        }
+
+        shared_ptr<hittable> object() const { return ptr; }
+        y_rotation rotation() const { return { sin_theta, cos_theta }; }
+
+    private:
+        // The box of the rotated object is the box around the 8 rotated corners of the object's box
+        void update_box(double time0, double time1);
+
+        // Ray in the object's space, i.e. rotated by -theta
+        ray rotate_ray(const ray& r) const;
+
     private:
         shared_ptr<hittable> ptr;
         double sin_theta;
@@ -134,13 +327,15 @@ class rotate_y : public hittable
         aabb bbox;
 };
 
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle)
-    : ptr(p)
+rotate_y::rotate_y(shared_ptr<hittable> p, const y_rotation& rotation)
+    : ptr(p), sin_theta(rotation.sin_theta), cos_theta(rotation.cos_theta)
+{
+    update_box(0, 1);
+}
+
+void rotate_y::update_box(double time0, double time1)
 {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    hasBox = ptr->bounding_box(0, 1, bbox);
+    hasBox = ptr->bounding_box(time0, time1, bbox);
 
     vec3 min(infinity, infinity, infinity);
     vec3 max(-infinity, -infinity, -infinity);
@@ -172,7 +367,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle)
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+ray rotate_y::rotate_ray(const ray& r) const
 {
     vec3 origin = r.origin();
     vec3 direction = r.direction();
@@ -183,7 +378,12 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
     direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    return ray(origin, direction, r.time());
+}
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+    ray rotated_r = rotate_ray(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
@@ -3,6 +3,7 @@
 #include "rtweekend.h"
 #include "hittable.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -16,32 +17,68 @@ class hittable_list: public hittable
         void clear() { objects.clear(); }
         void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+        {
+            return hit_deferred(*this, r, t_min, t_max, rec);
+        }
+
+        virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const;
+
+        virtual void refit(double time0, double time1)
+        {
+            for (const auto& object : objects)
+                object->refit(time0, time1);
+        }
         
 
         std::vector<shared_ptr<hittable>> objects;
 
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+// Refits every object once, even if several primitive references point to it (spatial splits
+// duplicate them). Serial on purpose: distinct objects can still share a child, e.g. two
+// wrappers around the same object, and refit() of the same object must not run concurrently.
+inline void refit_objects(const std::vector<shared_ptr<hittable>>& objects, double time0, double time1)
+{
+    std::vector<hittable*> unique;
+    unique.reserve(objects.size());
+    for (const auto& object : objects)
+        unique.push_back(object.get());
+    std::sort(unique.begin(), unique.end());
+    unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+    for (hittable* object : unique)
+        object->refit(time0, time1);
+}
+
+// Only the closest candidate so far is kept, its hit_record is filled once at the end by hit()
+bool hittable_list::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
 {
-    hit_record temp_rec;
     bool hit_anything = false;
     double closest_so_far = t_max;
 
     for (const auto& object : objects)
     {
-        if (object->hit(r, t_min, closest_so_far, temp_rec))
+        if (object->intersect(r, t_min, closest_so_far, candidate, rec))
         {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = candidate.t;
         }
     }
     return hit_anything;
 }
 
+// Any object blocking the ray will do, no need to find the closest one
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const
+{
+    for (const auto& object : objects)
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    return false;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const
 {
     if (objects.empty())
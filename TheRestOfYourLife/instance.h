@@ -0,0 +1,228 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "transform.h"
+
+
+/* Object placed in the scene with an affine transform. The object itself (usually a bottom level
+   BVH) is shared between all instances, so many copies of it only cost one transform each.
+   Replaces chains like translate(rotate_y(object)): the ray is transformed once with the combined
+   inverse transform instead of once per wrapper. */
+class instance : public hittable
+{
+	public:
+		instance(shared_ptr<hittable> p, const affine_transform& t);
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = box;
+			return has_box;
+		}
+
+		virtual bool occluded(const ray& r, double t_min, double t_max) const
+		{
+			return ptr->occluded(ray(transform.inverse_point(r.origin()), transform.inverse_vector(r.direction()), r.time()), t_min, t_max);
+		}
+
+		// t is the same in object space, see hit()
+		virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const
+		{
+			return ptr->hit_interval(ray(transform.inverse_point(r.origin()), transform.inverse_vector(r.direction()), r.time()), t_enter, t_exit);
+		}
+
+		// Only updates the box of this instance. The shared object has to be refitted once by whoever
+		// moved it, not once per instance.
+		virtual void refit(double time0, double time1)
+		{
+			update_box(time0, time1);
+		}
+
+		// Moves the instance, e.g. between frames of an animation
+		void set_transform(const affine_transform& t)
+		{
+			transform = t;
+			update_box(0, 1);
+		}
+
+	protected:
+		void update_box(double time0, double time1);
+
+	public:
+		shared_ptr<hittable> ptr;
+		affine_transform transform;
+
+	private:
+		bool has_box;
+		aabb box;
+};
+
+instance::instance(shared_ptr<hittable> p, const affine_transform& t)
+	: ptr(p), transform(t)
+{
+	update_box(0, 1);
+}
+
+void instance::update_box(double time0, double time1)
+{
+	has_box = ptr->bounding_box(time0, time1, box);
+	if (has_box)
+		box = transform.transform_box(box);
+}
+
+// The direction is not normalized in object space, so t is the same in both spaces.
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	ray local_r(transform.inverse_point(r.origin()), transform.inverse_vector(r.direction()), r.time());
+	if (!ptr->hit(local_r, t_min, t_max, rec))
+		return false;
+
+	// The inverse transpose keeps the sign of dot(direction, normal), so front_face stays valid
+	rec.p = transform.point(rec.p);
+	rec.normal = unit_vector(transform.normal(rec.normal));
+
+	return true;
+}
+
+// Walks a chain of transform wrappers (translate, rotate_y, instance) down to the object inside.
+// Returns the number of wrappers, transform is their combined transform.
+int unwrap_transforms(const shared_ptr<hittable>& object, affine_transform& transform, shared_ptr<hittable>& inner)
+{
+	transform = affine_transform();
+	inner = object;
+	int wrappers = 0;
+
+	// Outer wrappers are applied last: world = outer * ... * inner
+	for (;;)
+	{
+		if (auto moved = dynamic_cast<const translate*>(inner.get()))
+		{
+			transform = transform * affine_transform::translation(moved->displacement());
+			inner = moved->object();
+		}
+		else if (auto rotated = dynamic_cast<const rotate_y*>(inner.get()))
+		{
+			transform = transform * affine_transform::rotation_y(rotated->rotation());
+			inner = rotated->object();
+		}
+		else if (auto placed = dynamic_cast<const instance*>(inner.get()))
+		{
+			transform = transform * placed->transform;
+			inner = placed->ptr;
+		}
+		else
+		{
+			break;
+		}
+		++wrappers;
+	}
+	return wrappers;
+}
+
+/* Instance that replaces a chain of transform wrappers, made by fold_transforms(). It keeps the chain:
+   refit() refits it, which reaches the object inside just as the chain did, and takes over the
+   transforms of the wrappers again, so set_offset() / set_angle() calls on them between frames show
+   up after the next refit of the scene. */
+class folded_instance : public instance
+{
+	public:
+		folded_instance(shared_ptr<hittable> wrappers, shared_ptr<hittable> inner, const affine_transform& t)
+			: instance(inner, t), chain(wrappers)
+		{}
+
+		virtual void refit(double time0, double time1)
+		{
+			chain->refit(time0, time1);
+			unwrap_transforms(chain, transform, ptr);
+			update_box(time0, time1);
+		}
+
+	private:
+		shared_ptr<hittable> chain;
+};
+
+// Collapses a chain of transform wrappers around an object into one instance with the combined
+// transform, so a ray is transformed once instead of once per wrapper. Objects with less than two
+// wrappers are returned unchanged.
+shared_ptr<hittable> fold_transforms(const shared_ptr<hittable>& object)
+{
+	affine_transform transform;
+	shared_ptr<hittable> inner;
+	if (unwrap_transforms(object, transform, inner) < 2)
+		return object;
+	return make_shared<folded_instance>(object, inner, transform);
+}
+
+
+/* Two level acceleration structure: a flat BVH (top level) over instances, each pointing at a
+   shared bottom level structure. Moving instances only changes their transforms, so per frame only
+   the small top level BVH over the instance boxes is rebuilt. */
+class tlas : public hittable
+{
+	public:
+		tlas(double t0, double t1) : time0(t0), time1(t1) {}
+
+		// Adds an instance of the bottom level structure blas. Call rebuild() after adding instances.
+		shared_ptr<instance> add(shared_ptr<hittable> blas, const affine_transform& t);
+
+		// Rebuilds the top level BVH, e.g. after instances were moved with set_transform()
+		void rebuild();
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return accel && accel->hit(r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+		{
+			return accel && accel->intersect(r, t_min, t_max, candidate, rec);
+		}
+
+		virtual bool bounding_box(double t0, double t1, aabb& output_box) const
+		{
+			return accel && accel->bounding_box(t0, t1, output_box);
+		}
+
+		virtual bool occluded(const ray& r, double t_min, double t_max) const
+		{
+			return accel && accel->occluded(r, t_min, t_max);
+		}
+
+		// Instance boxes follow their (already refitted) objects, then the top level is rebuilt
+		virtual void refit(double t0, double t1)
+		{
+			time0 = t0;
+			time1 = t1;
+			for (const auto& object : instances.objects)
+				object->refit(time0, time1);
+			rebuild();
+		}
+
+	public:
+		hittable_list instances;
+
+	private:
+		shared_ptr<linear_bvh> accel;
+		double time0;
+		double time1;
+};
+
+shared_ptr<instance> tlas::add(shared_ptr<hittable> blas, const affine_transform& t)
+{
+	auto inst = make_shared<instance>(blas, t);
+	instances.add(inst);
+	return inst;
+}
+
+void tlas::rebuild()
+{
+	if (instances.objects.empty())
+	{
+		accel = nullptr;
+		return;
+	}
+	accel = make_shared<linear_bvh>(instances, time0, time1);
+}
@@ -0,0 +1,551 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <new>
+#include <queue>
+#include <vector>
+
+
+// Maximum depth of a flattened BVH, i.e. the size of the traversal stack. Trees from build_bvh()
+// never get deeper, subtrees of other bvh_node trees below this depth are kept as one primitive.
+const int linear_bvh_max_depth = bvh_max_depth;
+
+const size_t cache_line_bytes = 64;
+
+// Size of the treelets reorder_treelets() groups nodes into: one page
+const size_t linear_bvh_treelet_bytes = 4096;
+
+// Node of the flattened BVH. 32 bytes, so two nodes share a cache line.
+// Bounds are floats rounded outwards, so the float box always contains the double box of bvh_node.
+// The two children of a node are stored next to each other, starting at an even index, so a ray
+// that tests both children only touches one cache line.
+struct alignas(32) linear_bvh_node
+{
+	float bounds_min[3];
+	float bounds_max[3];
+	uint32_t offset;		// leaf: index of first primitive, interior: index of first child (second child is offset + 1)
+	uint16_t prim_count;	// number of primitives in a leaf, 0 for interior nodes
+	uint8_t axis;			// interior: axis the children are separated along, decides which child is visited first
+	uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) * 2 == cache_line_bytes, "linear_bvh_node has to fit two nodes per cache line");
+
+// Allocates on cache line boundaries, so the sibling pairs of a node array do not straddle two lines.
+// Arrays of a page or more start on a page boundary, so the treelets of reorder_treelets() are pages.
+template <typename T>
+struct cache_aligned_allocator
+{
+	using value_type = T;
+
+	cache_aligned_allocator() = default;
+	template <typename U>
+	cache_aligned_allocator(const cache_aligned_allocator<U>&) {}
+
+	T* allocate(size_t n)
+	{
+		return static_cast<T*>(::operator new(n * sizeof(T), alignment(n)));
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		::operator delete(p, alignment(n));
+	}
+
+	static std::align_val_t alignment(size_t n)
+	{
+		return std::align_val_t(n * sizeof(T) >= linear_bvh_treelet_bytes ? linear_bvh_treelet_bytes : cache_line_bytes);
+	}
+
+	template <typename U>
+	bool operator==(const cache_aligned_allocator<U>&) const { return true; }
+	template <typename U>
+	bool operator!=(const cache_aligned_allocator<U>&) const { return false; }
+};
+
+/* Node array of a linear_bvh. nodes[0] is the root, nodes[1] a copy of it that is never visited:
+   it only moves the sibling pairs to even indices. Children always have higher indices than their
+   parent. */
+using linear_bvh_nodes = std::vector<linear_bvh_node, cache_aligned_allocator<linear_bvh_node>>;
+
+inline float round_down(double x)
+{
+	float f = static_cast<float>(x);
+	return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double x)
+{
+	float f = static_cast<float>(x);
+	return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+inline void set_node_bounds(linear_bvh_node& node, const aabb& box)
+{
+	for (int a = 0; a < 3; ++a)
+	{
+		node.bounds_min[a] = round_down(box.min()[a]);
+		node.bounds_max[a] = round_up(box.max()[a]);
+	}
+}
+
+// Exit distances of the slab test are scaled by this (Ize, "Robust BVH Ray Traversal"), so the rounding
+// of the distances never culls a ray that touches a box only at an edge or corner, e.g. a ray through
+// a mesh vertex lying on the bounds.
+const double slab_exit_scale = 1 + 4 * std::numeric_limits<double>::epsilon();
+
+// Same slab test as aabb::hit, but with the inverse direction computed once per ray.
+inline bool node_hit(const linear_bvh_node& node, const ray& r, const vec3& inv_dir, const int dir_is_neg[3], double tmin, double tmax)
+{
+	const vec3 origin = r.origin();
+	for (int a = 0; a < 3; ++a)
+	{
+		double t0 = (node.bounds_min[a] - origin[a]) * inv_dir[a];
+		double t1 = (node.bounds_max[a] - origin[a]) * inv_dir[a];
+		if (dir_is_neg[a])
+			std::swap(t0, t1);
+		t1 *= slab_exit_scale;
+
+		tmin = t0 > tmin ? t0 : tmin;
+		tmax = t1 < tmax ? t1 : tmax;
+
+		if (tmax <= tmin)
+			return false;
+	}
+	return true;
+}
+
+/* Closest hit traversal of a flattened BVH with an explicit stack instead of recursion.
+   leaf(first, count, tmax) has to test the primitives [first, first + count) and return true if
+   one of them was hit closer than tmax, in which case it also lowers tmax to the new hit distance.
+   Children are visited front to back: If the ray travels in negative direction along the split axis,
+   the second child is closer and visited first. The traversal starts at the root, nodes[0].
+   Node can be any node type with offset, prim_count and axis like linear_bvh_node and a matching
+   node_hit overload. */
+template <typename Node, typename LeafFunc>
+bool traverse_linear_bvh(const Node* nodes, const ray& r, double tmin, double tmax, LeafFunc&& leaf)
+{
+	const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+	const int dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	uint32_t stack[linear_bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+	bool hit_anything = false;
+
+	while (true)
+	{
+		const Node& node = nodes[current];
+		if (node_hit(node, r, inv_dir, dir_is_neg, tmin, tmax))
+		{
+			if (node.prim_count > 0)
+			{
+				if (leaf(node.offset, node.prim_count, tmax))
+					hit_anything = true;
+			}
+			else if (dir_is_neg[node.axis])
+			{
+				stack[stack_size++] = node.offset;
+				current = node.offset + 1;
+				continue;
+			}
+			else
+			{
+				stack[stack_size++] = node.offset + 1;
+				current = node.offset;
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			break;
+		current = stack[--stack_size];
+	}
+
+	return hit_anything;
+}
+
+/* Any hit traversal for occlusion queries. leaf(first, count) returns true if one of the primitives
+   [first, first + count) blocks the ray, which ends the traversal. Nodes are still visited front to
+   back, close blockers are the likely ones. */
+template <typename Node, typename LeafFunc>
+bool occluded_linear_bvh(const Node* nodes, const ray& r, double tmin, double tmax, LeafFunc&& leaf)
+{
+	const vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+	const int dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+	uint32_t stack[linear_bvh_max_depth];
+	int stack_size = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		const Node& node = nodes[current];
+		if (node_hit(node, r, inv_dir, dir_is_neg, tmin, tmax))
+		{
+			if (node.prim_count > 0)
+			{
+				if (leaf(node.offset, node.prim_count))
+					return true;
+			}
+			else if (dir_is_neg[node.axis])
+			{
+				stack[stack_size++] = node.offset;
+				current = node.offset + 1;
+				continue;
+			}
+			else
+			{
+				stack[stack_size++] = node.offset + 1;
+				current = node.offset;
+				continue;
+			}
+		}
+
+		if (stack_size == 0)
+			return false;
+		current = stack[--stack_size];
+	}
+}
+
+
+/* BVH flattened into one contiguous array of sibling pairs in depth-first order. The topology is
+   taken from a bvh_node tree or directly from the SAH builder (without creating bvh_nodes first).
+   Traversal does not chase shared_ptrs and needs no virtual call per node, only per primitive.
+   Drop-in replacement for bvh_node: construct it from the same hittable_list. */
+class linear_bvh : public hittable
+{
+	public:
+		linear_bvh(hittable_list& list, double time0, double time1, const bvh_build_options& options = bvh_build_options());
+
+		linear_bvh(const shared_ptr<bvh_node>& root, double time0, double time1);
+
+		// Takes over an already flattened tree, e.g. loaded from the BVH cache
+		linear_bvh(linear_bvh_nodes flat_nodes, std::vector<shared_ptr<hittable>> flat_primitives);
+
+		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, tmin, tmax, rec);
+		}
+
+		virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
+		virtual bool occluded(const ray& r, double tmin, double tmax) const;
+
+		// Recomputes all node bounds after primitives moved. Children always have higher indices
+		// than their parent, so one backwards pass over the array visits them first.
+		virtual void refit(double time0, double time1);
+
+		// Reorders the nodes into page sized and page aligned treelets, so the nodes a ray visits after
+		// entering a subtree are on few pages. Only the layout changes, traversal visits the same nodes.
+		void reorder_treelets();
+
+		// Bytes of the nodes and primitive references, without the primitives themselves
+		size_t memory_bytes() const
+		{
+			return nodes.size() * sizeof(linear_bvh_node) + primitives.size() * sizeof(shared_ptr<hittable>);
+		}
+
+	public:
+		linear_bvh_nodes nodes;
+		std::vector<shared_ptr<hittable>> primitives;
+		aabb box;
+		bvh_build_stats build_stats;	// only filled when built from a list
+
+	private:
+		void update_box();
+		void flatten(const shared_ptr<hittable>& object, size_t index, double time0, double time1, int depth);
+		void flatten(const bvh_build_result& result, uint32_t build_index, size_t index, const std::vector<shared_ptr<hittable>>& objects);
+};
+
+inline double node_surface_area(const linear_bvh_node& node)
+{
+	double dx = node.bounds_max[0] - node.bounds_min[0];
+	double dy = node.bounds_max[1] - node.bounds_min[1];
+	double dz = node.bounds_max[2] - node.bounds_min[2];
+	return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+linear_bvh::linear_bvh(hittable_list& list, double time0, double time1, const bvh_build_options& options)
+{
+	bvh_build_result result = build_bvh(make_bvh_primitives(list.objects, 0, list.objects.size(), time0, time1), options);
+	build_stats = result.stats;
+	box = result.nodes[0].box;
+	nodes.reserve(result.nodes.size() + 1);
+	primitives.reserve(result.primitives.size());
+	nodes.resize(2);
+	flatten(result, 0, 0, list.objects);
+	nodes[1] = nodes[0];
+}
+
+linear_bvh::linear_bvh(const shared_ptr<bvh_node>& root, double time0, double time1)
+{
+	box = root->box;
+	nodes.resize(2);
+	flatten(root, 0, time0, time1, 1);
+	nodes[1] = nodes[0];
+}
+
+linear_bvh::linear_bvh(linear_bvh_nodes flat_nodes, std::vector<shared_ptr<hittable>> flat_primitives)
+	: nodes(std::move(flat_nodes)), primitives(std::move(flat_primitives))
+{
+	update_box();
+}
+
+// Writes the subtree of object to nodes[index], children are appended as pairs in depth-first order.
+// bvh_node leaves (hittable_lists) are expanded into their objects, everything else is a primitive.
+// At the maximum depth, an interior bvh_node becomes a primitive too and traverses its subtree itself.
+void linear_bvh::flatten(const shared_ptr<hittable>& object, size_t index, double time0, double time1, int depth)
+{
+	auto node = std::dynamic_pointer_cast<bvh_node>(object);
+	if (node && !node->right)
+	{
+		flatten(node->left, index, time0, time1, depth);
+		return;
+	}
+
+	linear_bvh_node flat = {};
+
+	if (node && depth < linear_bvh_max_depth)
+	{
+		aabb box_left;
+		aabb box_right;
+		node->left->bounding_box(time0, time1, box_left);
+		node->right->bounding_box(time0, time1, box_right);
+
+		// Visit order is decided along the axis the child boxes are separated most
+		vec3 d = box_right.centroid() - box_left.centroid();
+		int axis = 0;
+		for (int a = 1; a < 3; ++a)
+			if (std::abs(d[a]) > std::abs(d[axis])) axis = a;
+
+		set_node_bounds(flat, node->box);
+		flat.axis = static_cast<uint8_t>(axis);
+
+		// Both children are allocated together, so they end up next to each other
+		flat.offset = static_cast<uint32_t>(nodes.size());
+		nodes[index] = flat;
+		nodes.resize(nodes.size() + 2);
+		flatten(node->left, flat.offset, time0, time1, depth + 1);
+		flatten(node->right, flat.offset + 1, time0, time1, depth + 1);
+		return;
+	}
+
+	aabb leaf_box;
+	if (!object->bounding_box(time0, time1, leaf_box))
+		std::cerr << "No bounding box in linear_bvh constructor.\n";
+	set_node_bounds(flat, leaf_box);
+	flat.offset = static_cast<uint32_t>(primitives.size());
+
+	auto list = std::dynamic_pointer_cast<hittable_list>(object);
+	if (list && !list->objects.empty() && list->objects.size() <= UINT16_MAX)
+	{
+		for (const auto& prim : list->objects)
+			primitives.push_back(prim);
+		flat.prim_count = static_cast<uint16_t>(list->objects.size());
+	}
+	else
+	{
+		primitives.push_back(object);
+		flat.prim_count = 1;
+	}
+
+	nodes[index] = flat;
+}
+
+// Writes a subtree of the builder output to nodes[index], children are appended as pairs.
+// build_bvh() keeps the tree within linear_bvh_max_depth, so it always fits the traversal stack.
+void linear_bvh::flatten(const bvh_build_result& result, uint32_t build_index, size_t index, const std::vector<shared_ptr<hittable>>& objects)
+{
+	const bvh_build_node& node = result.nodes[build_index];
+	linear_bvh_node flat = {};
+	set_node_bounds(flat, node.box);
+
+	if (node.count > 0)
+	{
+		flat.offset = static_cast<uint32_t>(primitives.size());
+		flat.prim_count = static_cast<uint16_t>(node.count);
+		for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			primitives.push_back(objects[result.primitives[i].index]);
+		nodes[index] = flat;
+		return;
+	}
+
+	flat.axis = static_cast<uint8_t>(node.axis);
+	flat.offset = static_cast<uint32_t>(nodes.size());
+	nodes[index] = flat;
+	nodes.resize(nodes.size() + 2);
+
+	flatten(result, node.first, flat.offset, objects);
+	flatten(result, node.second, flat.offset + 1, objects);
+}
+
+bool linear_bvh::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	output_box = box;
+	return true;
+}
+
+void linear_bvh::refit(double time0, double time1)
+{
+	refit_objects(primitives, time0, time1);
+
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		linear_bvh_node& node = nodes[i];
+		if (node.prim_count > 0)
+		{
+			aabb leaf_box;
+			for (uint32_t p = node.offset; p < node.offset + node.prim_count; ++p)
+			{
+				aabb prim_box;
+				if (!primitives[p]->bounding_box(time0, time1, prim_box))
+					std::cerr << "No bounding box in linear_bvh::refit.\n";
+				if (p == node.offset)
+					leaf_box = prim_box;
+				else
+					leaf_box.expand(prim_box);
+			}
+			set_node_bounds(node, leaf_box);
+			continue;
+		}
+
+		const linear_bvh_node& first = nodes[node.offset];
+		const linear_bvh_node& second = nodes[node.offset + 1];
+		for (int a = 0; a < 3; ++a)
+		{
+			node.bounds_min[a] = std::min(first.bounds_min[a], second.bounds_min[a]);
+			node.bounds_max[a] = std::max(first.bounds_max[a], second.bounds_max[a]);
+		}
+	}
+
+	update_box();
+}
+
+/* Depth-first order puts the nodes of one subtree close together, but a ray that enters a subtree
+   mostly follows its largest children, which may be far apart in the array. Here sibling pairs are
+   grouped into treelets of one page instead: Starting with the pair at the top of a treelet, the pair
+   below the node with the largest surface area (the one a ray entering the treelet most likely
+   visits) is added next, until the page is full. The pairs below its border start new treelets,
+   placed depth first after it. Parents stay in front of their children.
+   No treelet crosses a page boundary: a subtree that fits into the rest of the current page is placed
+   there as a whole, a larger one fills the rest of the page as a smaller treelet. Only if less than a
+   quarter of the page is left, it is padded and the treelet starts on the next page. */
+void linear_bvh::reorder_treelets()
+{
+	if (nodes.size() <= 2 || nodes[0].prim_count > 0)
+		return;
+
+	const size_t pairs_per_treelet = std::max<size_t>(1, linear_bvh_treelet_bytes / cache_line_bytes);
+
+	// Number of sibling pairs in the subtree below each node, children come after their parent
+	std::vector<uint32_t> subtree_pairs(nodes.size(), 0);
+	for (size_t i = nodes.size(); i-- > 2;)
+		if (nodes[i].prim_count == 0)
+			subtree_pairs[i] = 1 + subtree_pairs[nodes[i].offset] + subtree_pairs[nodes[i].offset + 1];
+
+	// Padding is an unreachable leaf of primitive 0, so refit() and the BVH cache treat it like any node
+	linear_bvh_node padding = {};
+	padding.prim_count = 1;
+
+	struct pending_pair
+	{
+		double area;		// of the parent
+		uint32_t first;		// old index of the first child
+		uint32_t parent;	// new index of the parent
+	};
+	auto smaller_area = [](const pending_pair& a, const pending_pair& b) { return a.area < b.area; };
+
+	linear_bvh_nodes reordered;
+	reordered.reserve(nodes.size());
+	reordered.push_back(nodes[0]);
+	reordered.push_back(nodes[0]);
+
+	// The root pair is part of the first treelet
+	std::vector<pending_pair> treelet_roots = { { node_surface_area(nodes[0]), nodes[0].offset, 0 } };
+	std::vector<pending_pair> border;
+	while (!treelet_roots.empty())
+	{
+		std::priority_queue<pending_pair, std::vector<pending_pair>, decltype(smaller_area)> frontier(smaller_area);
+		const pending_pair root = treelet_roots.back();
+		frontier.push(root);
+		treelet_roots.pop_back();
+
+		size_t free_pairs = pairs_per_treelet - (reordered.size() / 2) % pairs_per_treelet;
+		const size_t root_pairs = 1 + subtree_pairs[root.first] + subtree_pairs[root.first + 1];
+		if (root_pairs > free_pairs && free_pairs < pairs_per_treelet / 4 && root.parent != 0)
+		{
+			reordered.resize(reordered.size() + 2 * free_pairs, padding);
+			free_pairs = pairs_per_treelet;
+		}
+
+		for (size_t count = 0; count < free_pairs && !frontier.empty(); ++count)
+		{
+			const pending_pair pair = frontier.top();
+			frontier.pop();
+
+			const uint32_t first = static_cast<uint32_t>(reordered.size());
+			reordered[pair.parent].offset = first;
+			for (uint32_t c = 0; c < 2; ++c)
+			{
+				const linear_bvh_node& child = nodes[pair.first + c];
+				reordered.push_back(child);
+				if (child.prim_count == 0)
+					frontier.push({ node_surface_area(child), child.offset, first + c });
+			}
+		}
+
+		// Largest border pair on top of the stack, so its treelet directly follows
+		border.clear();
+		for (; !frontier.empty(); frontier.pop())
+			border.push_back(frontier.top());
+		treelet_roots.insert(treelet_roots.end(), border.rbegin(), border.rend());
+	}
+
+	reordered[1] = reordered[0];
+	nodes = std::move(reordered);
+}
+
+// Box of the whole tree from the (float) root bounds
+void linear_bvh::update_box()
+{
+	if (nodes.empty())
+		return;
+
+	const linear_bvh_node& root = nodes[0];
+	box = aabb(vec3(root.bounds_min[0], root.bounds_min[1], root.bounds_min[2]),
+		vec3(root.bounds_max[0], root.bounds_max[1], root.bounds_max[2]));
+}
+
+bool linear_bvh::intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const
+{
+	return traverse_linear_bvh(nodes.data(), r, tmin, tmax, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		bool hit_anything = false;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			if (primitives[i]->intersect(r, tmin, closest, candidate, rec))
+			{
+				hit_anything = true;
+				closest = candidate.t;
+			}
+		}
+		return hit_anything;
+	});
+}
+
+bool linear_bvh::occluded(const ray& r, double tmin, double tmax) const
+{
+	return occluded_linear_bvh(nodes.data(), r, tmin, tmax, [&](uint32_t first, uint32_t count)
+	{
+		for (uint32_t i = first; i < first + count; ++i)
+			if (primitives[i]->occluded(r, tmin, tmax))
+				return true;
+		return false;
+	});
+}
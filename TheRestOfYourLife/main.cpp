@@ -1,9 +1,18 @@
 #include <fstream>
 #include <chrono>
+#include <filesystem>
 #include <ppl.h>
 
 #include "rtweekend.h"
 #include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "compressed_bvh.h"
+#include "motion_bvh.h"
+#include "tagged_bvh.h"
+#include "instance.h"
+#include "bvh_cache.h"
+#include "bvh_optimize.h"
 #include "camera.h"
 #include "hittable_list.h"
 #include "material.h"
@@ -13,8 +22,15 @@
 #include "rtw_stb_image.h"
 #include "box.h"
 #include "constant_medium.h"
+#include "grid_medium.h"
+#include "plane.h"
+#include "scene.h"
+#include "triangle_mesh.h"
+#include "mesh_loader.h"
+#include "sphere_set.h"
 
 #include "pi.h"
+#include "benchmark.h"
 
 
 vec3 ray_color(const ray& r, const vec3& background, const hittable &world, int depth)
@@ -48,7 +64,68 @@ vec3 ray_color(const ray& r, const vec3& background, const hittable &world, int
 }
 
 
-hittable_list random_scene()
+shared_ptr<hittable> build_linear_bvh(hittable_list& list, double time0, double time1)
+{
+    return make_shared<linear_bvh>(list, time0, time1);
+}
+
+// Loads the BVH from a cache file if the scene geometry did not change since the last run.
+// Opt in, see scene_accel in main(). Files are kept in ../bvh_cache (ignored by git), one per scene
+// hash; delete the directory to drop old ones.
+shared_ptr<hittable> build_cached_linear_bvh(hittable_list& list, double time0, double time1)
+{
+    std::error_code error;
+    std::filesystem::create_directories("../bvh_cache", error);
+    return load_or_build_linear_bvh(list, time0, time1, "../bvh_cache/bvh_");
+}
+
+// Linear BVH built with spatial splits, for scenes with large primitives next to small ones
+shared_ptr<hittable> build_sbvh(hittable_list& list, double time0, double time1)
+{
+    bvh_build_options options;
+    options.spatial_splits = true;
+    return make_shared<linear_bvh>(list, time0, time1, options);
+}
+
+shared_ptr<hittable> build_bvh_node(hittable_list& list, double time0, double time1)
+{
+    return make_shared<bvh_node>(list, time0, time1);
+}
+
+// Optimizes the BVH of a scene for a fixed view: pilot camera and bounce rays are traced through the
+// whole scene, so they also stop at and bounce off the large objects and the fog outside the BVH,
+// then the tree is rotated to suit them and flattened. Pays off when the same view is rendered many
+// times (e.g. turntable jobs). The scene has to be built with build_bvh_node.
+void optimize_scene_for_view(scene& world, const camera& cam, int pilot_width, int pilot_height, double time0, double time1)
+{
+    auto root = std::dynamic_pointer_cast<bvh_node>(world.accel);
+    if (!root)
+    {
+        std::cerr << "optimize_scene_for_view needs a scene built with build_bvh_node.\n";
+        return;
+    }
+
+    camera pilot_cam = cam;
+    auto rays = trace_pilot_rays(world, pilot_cam, pilot_width, pilot_height, 2);
+    optimize_bvh_for_rays(*root, rays, time0, time1);
+    world.accel = make_shared<linear_bvh>(root, time0, time1);
+}
+
+// Linear BVH with its nodes grouped into page sized treelets, for scenes whose nodes do not fit into the caches
+shared_ptr<hittable> build_treelet_linear_bvh(hittable_list& list, double time0, double time1)
+{
+    auto bvh = make_shared<linear_bvh>(list, time0, time1);
+    bvh->reorder_treelets();
+    return bvh;
+}
+
+// For scenes with motion blur: node bounds follow the moving objects over the shutter interval
+shared_ptr<hittable> build_motion_bvh(hittable_list& list, double time0, double time1)
+{
+    return make_shared<motion_bvh>(list, time0, time1);
+}
+
+hittable_list random_scene(const accel_builder& build_accel = build_linear_bvh)
 {
     hittable_list world;
 
@@ -60,8 +137,8 @@ hittable_list random_scene()
         make_shared<constant_texture>(vec3(0.9, 0.9, 0.9))
     );
 
-    // Checker sphere as world
-    world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    // Checker plane as world (used to be a sphere of radius 1000)
+    world.add(make_shared<plane>(vec3(0, 0, 0), vec3(0, 1, 0), make_shared<lambertian>(checker)));
 
     int i = 1;
     for (int a = -12; a < 12; a++)
@@ -123,7 +200,7 @@ hittable_list random_scene()
 
 
     //return world;
-    return hittable_list(make_shared<bvh_node>(world, 0.0, 1.0));
+    return hittable_list(make_shared<scene>(world, 0.0, 1.0, build_accel));
 }
 
 hittable_list two_spheres()
@@ -146,7 +223,7 @@ hittable_list two_perlin_spheres()
     hittable_list objects;
 
     auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
+    objects.add(make_shared<plane>(vec3(0, 0, 0), vec3(0, 1, 0), make_shared<lambertian>(pertext)));
     objects.add(make_shared<sphere>(vec3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
 
     return objects;
@@ -171,7 +248,7 @@ hittable_list simple_light()
     hittable_list objects;
 
     auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
+    objects.add(make_shared<plane>(vec3(0, 0, 0), vec3(0, 1, 0), make_shared<lambertian>(pertext)));
     objects.add(make_shared<sphere>(vec3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
 
     auto difflight = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(4, 4, 4)));
@@ -181,6 +258,45 @@ hittable_list simple_light()
     return objects;
 }
 
+// Fixed Cornell room description. Everything in here is constexpr, so the room size and the box
+// transforms (including the sine / cosine of rotate_y) are folded into constants at compile time.
+namespace cornell
+{
+    constexpr double room_size = 555;
+
+    struct box_placement
+    {
+        vec3 size;
+        y_rotation rotation;
+        vec3 offset;
+    };
+
+    constexpr box_placement tall_box{ vec3(165, 330, 165), make_y_rotation(15), vec3(265, 0, 295) };
+    constexpr box_placement short_box{ vec3(165, 165, 165), make_y_rotation(-18), vec3(130, 0, 65) };
+
+    static_assert(tall_box.rotation.cos_theta > 0.96 && tall_box.rotation.sin_theta > 0.25,
+        "rotate_y constants must be evaluated at compile time");
+}
+
+// Adds the five walls of the Cornell room (without the light)
+void add_cornell_walls(hittable_list& objects, shared_ptr<material> red, shared_ptr<material> green, shared_ptr<material> white)
+{
+    constexpr double s = cornell::room_size;
+
+    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, s, 0, s, s, green))); // left
+    objects.add(make_shared<yz_rect>(0, s, 0, s, 0, red)); // right
+    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, s, 0, s, s, white))); // top
+    objects.add(make_shared<xz_rect>(0, s, 0, s, 0, white)); // bottom
+    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, s, 0, s, s, white))); // back
+}
+
+// Box standing on the floor of the Cornell room, rotated and moved to its precomputed placement
+shared_ptr<hittable> make_cornell_box(const cornell::box_placement& placement, shared_ptr<material> mat)
+{
+    auto b = make_shared<box>(vec3(0, 0, 0), placement.size, mat);
+    return make_shared<instance>(b, affine_transform::translation(placement.offset) * affine_transform::rotation_y(placement.rotation));
+}
+
 hittable_list cornell_box()
 {
     hittable_list objects;
@@ -190,22 +306,11 @@ hittable_list cornell_box()
     auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
     auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(15, 15, 15)));
 
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green))); // left
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red)); // right
+    add_cornell_walls(objects, red, green, white);
     objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light)); // 213, 343, 227, 332, 554  // 120, 420, 120, 420, 554
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white))); // top
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white)); // bottom
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white))); // back
-
-    shared_ptr<hittable> box1 = make_shared<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-    objects.add(box1);
-
-    shared_ptr<hittable> box2 = make_shared<box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
-    objects.add(box2);
+
+    objects.add(make_cornell_box(cornell::tall_box, white));
+    objects.add(make_cornell_box(cornell::short_box, white));
     
     return objects;
 }
@@ -222,12 +327,8 @@ hittable_list cornell_balls()
     auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
     auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(5, 5, 5)));
 
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    add_cornell_walls(objects, red, green, white);
     objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white)));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
 
     auto boundary = make_shared<sphere>(vec3(160, 100, 145), 100, make_shared<dielectric>(1.5));
     objects.add(boundary);
@@ -238,10 +339,7 @@ hittable_list cornell_balls()
     auto boundary2 = make_shared<sphere>(vec3(380, 100, 50), 100, make_shared<dielectric>(1.5));
     objects.add(boundary2);
 
-    shared_ptr<hittable> box1 = make_shared<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-    objects.add(box1);
+    objects.add(make_cornell_box(cornell::tall_box, white));
 
     return objects;
 }
@@ -255,20 +353,11 @@ hittable_list cornell_smoke()
     auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
     auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(7, 7, 7)));
 
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green))); // left
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red)); // right
+    add_cornell_walls(objects, red, green, white);
     objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white))); // top
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white)); // bottom
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white))); // back
-
-    shared_ptr<hittable> box1 = make_shared<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
 
-    shared_ptr<hittable> box2 = make_shared<box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    auto box1 = make_cornell_box(cornell::tall_box, white);
+    auto box2 = make_cornell_box(cornell::short_box, white);
 
     objects.add(make_shared<constant_medium>(box1, 0.01, make_shared<constant_texture>(vec3(0, 0, 0))));
     objects.add(make_shared<constant_medium>(box2, 0.01, make_shared<constant_texture>(vec3(1, 1, 1))));
@@ -276,6 +365,30 @@ hittable_list cornell_smoke()
     return objects;
 }
 
+// Cloud of Perlin turbulence in a 64^3 density grid, fading out towards a sphere around the grid center
+hittable_list cornell_cloud()
+{
+    hittable_list objects;
+
+    auto red = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(7, 7, 7)));
+
+    add_cornell_walls(objects, red, green, white);
+    objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
+
+    const int n = 64;
+    auto grid = make_noise_density_grid(n, n, n, 0.08, 0.3, [](int i, int j, int k)
+    {
+        const double r = (vec3(i, j, k) - vec3(n / 2, n / 2, n / 2)).length() / (n / 2);
+        return std::max(0.0, 1 - r * r);
+    });
+    objects.add(make_shared<grid_medium>(grid, aabb(vec3(100, 80, 100), vec3(455, 435, 455)), 0.2, make_shared<constant_texture>(vec3(1, 1, 1))));
+
+    return objects;
+}
+
 hittable_list cornell_final() 
 {
     hittable_list objects;
@@ -292,17 +405,10 @@ hittable_list cornell_final()
     auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
     auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(7, 7, 7)));
 
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    add_cornell_walls(objects, red, green, white);
     objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white)));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
 
-    shared_ptr<hittable> boundary2 =
-        make_shared<box>(vec3(0, 0, 0), vec3(165, 165, 165), make_shared<dielectric>(1.5));
-    boundary2 = make_shared<rotate_y>(boundary2, -18);
-    boundary2 = make_shared<translate>(boundary2, vec3(130, 0, 65));
+    auto boundary2 = make_cornell_box(cornell::short_box, make_shared<dielectric>(1.5));
 
     auto tex = make_shared<constant_texture>(vec3(0.9, 0.9, 0.9));
 
@@ -312,17 +418,48 @@ hittable_list cornell_final()
     return objects;
 }
 
-hittable_list final_scene()
+// Cornell box with a mesh from an .obj or .ply file standing on the floor in the middle. The mesh is
+// expected in the units of the box (about 100 - 300 across). Falls back to the tall box if it cannot be loaded.
+hittable_list cornell_mesh(const std::string& path)
+{
+    hittable_list objects;
+
+    auto red = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(15, 15, 15)));
+
+    add_cornell_walls(objects, red, green, white);
+    objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
+
+    auto mesh = load_triangle_mesh(path, white);
+    if (!mesh)
+    {
+        objects.add(make_cornell_box(cornell::tall_box, white));
+        return objects;
+    }
+
+    aabb mesh_box;
+    mesh->bounding_box(0, 1, mesh_box);
+    const vec3 offset(278 - 0.5 * (mesh_box.min().x() + mesh_box.max().x()), -mesh_box.min().y(), 278 - 0.5 * (mesh_box.min().z() + mesh_box.max().z()));
+    objects.add(make_shared<instance>(mesh, affine_transform::translation(offset)));
+
+    return objects;
+}
+
+// detail > 1 scales the scene up for benchmarks: detail^2 times as many ground boxes and spheres in
+// the cluster, each smaller by detail, so the scene covers the same space.
+hittable_list final_scene(const accel_builder& build_accel = build_linear_bvh, int detail = 1)
 {
     hittable_list boxes1;
     auto ground = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.48, 0.83, 0.53)));
 
-    const int boxes_per_side = 20;
+    const int boxes_per_side = 20 * detail;
     for (int i = 0; i < boxes_per_side; ++i)
     {
         for (int j = 0; j < boxes_per_side; ++j)
         {
-            auto w = 100;
+            auto w = 100.0 / detail;
             auto x0 = -1000.0 + i * w;
             auto z0 = -1000.0 + j * w;
             auto y0 = 0.0;
@@ -336,7 +473,7 @@ hittable_list final_scene()
 
     hittable_list objects;
 
-    objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+    objects.add(build_accel(boxes1, 0, 1));
 
     auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(7, 7, 7)));
     objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
@@ -354,9 +491,6 @@ hittable_list final_scene()
     objects.add(boundary);
     objects.add(make_shared<constant_medium>(boundary, 0.2, make_shared<constant_texture>(vec3(0.2, 0.4, 0.9))));
 
-    boundary = make_shared<sphere>(vec3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-    objects.add(make_shared<constant_medium>(boundary, 0.0001, make_shared<constant_texture>(vec3(1, 1, 1))));
-
     int nx;
     int ny;
     int nn;
@@ -367,21 +501,206 @@ hittable_list final_scene()
     auto pertext = make_shared<noise_texture>(0.1);
     objects.add(make_shared<sphere>(vec3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
 
-    hittable_list boxes2;
+    auto cluster = make_shared<sphere_set>();
     auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
-    int ns = 1000;
+    int ns = 1000 * detail * detail;
     for (int j = 0; j < ns; ++j)
     {
-        boxes2.add(make_shared<sphere>(vec3::random(0, 165), 10, white));
+        cluster->add(vec3::random(0, 165), 10.0 / detail, white);
     }
+    cluster->build();
+
+    // The sphere cluster is its own bottom level BVH, placed by an instance in a top level BVH.
+    // Moving it later only needs set_transform() and a rebuild of the top level.
+    constexpr auto cluster_rotation = make_y_rotation(15);
+    auto cluster_transform = affine_transform::translation(vec3(-100, 270, 395)) * affine_transform::rotation_y(cluster_rotation);
+    auto clusters = make_shared<tlas>(0.0, 1.0);
+    clusters->add(cluster, cluster_transform);
+    clusters->rebuild();
+    objects.add(clusters);
+
+    // The thin fog that used to be a constant_medium in a sphere of radius 5000 is sampled by the scene
+    auto world = make_shared<scene>(objects, 0.0, 1.0, build_accel);
+    world->fog = make_shared<homogeneous_fog>(0.0001, make_shared<constant_texture>(vec3(1, 1, 1)), vec3(0, 0, 0), 5000);
+    return hittable_list(world);
+}
 
-    objects.add(make_shared<translate>(make_shared<rotate_y>(make_shared<bvh_node>(boxes2, 0.0, 1.0), 15), vec3(-100, 270, 395)));
+// Compares build time and closest hit throughput of the BVH variants on camera rays.
+// Scenes are rebuilt with the same random seed for every structure.
+void bvh_benchmark()
+{
+    const int width = 400;
+    const int height = 400;
 
-    return objects;
+    struct accel_variant
+    {
+        const char* name;
+        accel_builder build;
+    };
+
+    const accel_variant variants[] = {
+        { "bvh_node", build_bvh_node },
+        { "linear_bvh", build_linear_bvh },
+        { "qbvh", [](hittable_list& l, double t0, double t1) -> shared_ptr<hittable> { return make_shared<qbvh>(l, t0, t1); } },
+        { "obvh", [](hittable_list& l, double t0, double t1) -> shared_ptr<hittable> { return make_shared<obvh>(l, t0, t1); } },
+        { "compressed", [](hittable_list& l, double t0, double t1) -> shared_ptr<hittable> { return make_shared<compressed_bvh>(l, t0, t1); } },
+        { "tagged_bvh", [](hittable_list& l, double t0, double t1) -> shared_ptr<hittable> { return make_shared<tagged_bvh>(l, t0, t1); } },
+        { "motion_bvh", build_motion_bvh },
+        { "sbvh", build_sbvh },
+    };
+
+    for (const auto& variant : variants)
+    {
+        hittable_list world;
+        std::srand(1);
+        double build_seconds = time_seconds([&]() { world = random_scene(variant.build); });
+        camera cam(vec3(13, 2, 3), vec3(0, 0, 0), vec3(0, 1, 0), 20, 1, 0, 10, 0.0, 1.0);
+        const auto rays = make_camera_rays(cam, width, height);
+        print_benchmark_row("random_scene", variant.name, build_seconds, benchmark_hits(world, rays));
+        print_benchmark_row("random_occl", variant.name, build_seconds, benchmark_occlusion(world, rays));
+    }
+
+    // Optimized for the view of the benchmark rays
+    {
+        hittable_list world;
+        std::srand(1);
+        camera cam(vec3(13, 2, 3), vec3(0, 0, 0), vec3(0, 1, 0), 20, 1, 0, 10, 0.0, 1.0);
+        double build_seconds = time_seconds([&]()
+        {
+            world = random_scene(build_bvh_node);
+            optimize_scene_for_view(*std::static_pointer_cast<scene>(world.objects[0]), cam, 64, 64, 0.0, 1.0);
+        });
+        print_benchmark_row("random_scene", "view_opt", build_seconds, benchmark_hits(world, make_camera_rays(cam, width, height)));
+    }
+
+    for (const auto& variant : variants)
+    {
+        hittable_list world;
+        std::srand(1);
+        double build_seconds = time_seconds([&]() { world = final_scene(variant.build); });
+        camera cam(vec3(478, 278, -600), vec3(278, 278, 0), vec3(0, 1, 0), 40, 1, 0, 10, 0.0, 1.0);
+        print_benchmark_row("final_scene", variant.name, build_seconds, benchmark_hits(world, make_camera_rays(cam, width, height)));
+    }
+
+    // The Cornell walls overlap everything inside the room, spatial splits cut them into pieces
+    hittable_list cornell = cornell_box();
+    camera cornell_cam(vec3(278, 278, -800), vec3(278, 278, 0), vec3(0, 1, 0), 40, 1, 0, 10, 0.0, 1.0);
+    const auto cornell_rays = make_camera_rays(cornell_cam, width, height);
+    for (const auto& variant : variants)
+    {
+        shared_ptr<hittable> world;
+        double build_seconds = time_seconds([&]() { world = variant.build(cornell, 0, 1); });
+        print_benchmark_row("cornell_box", variant.name, build_seconds, benchmark_hits(*world, cornell_rays));
+    }
+
+    // Node layout on a scene too large for the caches: same tree, depth first or grouped into treelets
+    const accel_variant layouts[] = {
+        { "depth_first", build_linear_bvh },
+        { "treelets", build_treelet_linear_bvh },
+    };
+    for (const auto& layout : layouts)
+    {
+        hittable_list world;
+        std::srand(1);
+        double build_seconds = time_seconds([&]() { world = final_scene(layout.build, 16); });
+        camera cam(vec3(478, 278, -600), vec3(278, 278, 0), vec3(0, 1, 0), 40, 1, 0, 10, 0.0, 1.0);
+        print_benchmark_row("final_scene x16", layout.name, build_seconds, benchmark_hits(world, make_camera_rays(cam, width, height)));
+    }
+
+    // Animated instances: per frame every instance moves. The two level structure only rebuilds the
+    // top level over the instance boxes, the flat one rebuilds a BVH over all transformed spheres.
+    {
+        auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
+        auto cluster = make_shared<sphere_set>();
+        for (int j = 0; j < 1000; ++j)
+            cluster->add(vec3::random(0, 165), 10.0, white);
+        cluster->build();
+
+        const int grid = 8;
+        const int frames = 10;
+        auto frame_transform = [&](int i, int frame)
+        {
+            const vec3 offset((i % grid) * 250.0 - 1000, 0, (i / grid) * 250.0 - 1000);
+            return affine_transform::translation(offset) * affine_transform::rotation_y(make_y_rotation(10.0 * frame + i));
+        };
+
+        tlas animated(0, 1);
+        std::vector<shared_ptr<instance>> placed;
+        for (int i = 0; i < grid * grid; ++i)
+            placed.push_back(animated.add(cluster, frame_transform(i, 0)));
+
+        sphere_set flat;
+        double tlas_seconds = 0;
+        double flat_seconds = 0;
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            tlas_seconds += time_seconds([&]()
+            {
+                for (int i = 0; i < grid * grid; ++i)
+                    placed[i]->set_transform(frame_transform(i, frame));
+                animated.rebuild();
+            });
+            flat_seconds += time_seconds([&]()
+            {
+                flat = sphere_set();
+                for (int i = 0; i < grid * grid; ++i)
+                {
+                    const affine_transform t = frame_transform(i, frame);
+                    for (size_t k = 0; k < cluster->size(); ++k)
+                        flat.add(t.point(cluster->centers[k]), cluster->radii[k], cluster->materials[cluster->material_ids[k]]);
+                }
+                flat.build();
+            });
+        }
+
+        camera cam(vec3(0, 1500, -1800), vec3(0, 80, 0), vec3(0, 1, 0), 40, 1, 0, 10, 0.0, 1.0);
+        const auto rays = make_camera_rays(cam, width, height);
+        print_benchmark_row("instances x64", "tlas", tlas_seconds / frames, benchmark_hits(animated, rays));
+        print_benchmark_row("instances x64", "flat", flat_seconds / frames, benchmark_hits(flat, rays));
+    }
+
+    bvh_build_options sbvh_options;
+    sbvh_options.spatial_splits = true;
+    print_bvh_build_stats("cornell bvh", linear_bvh(cornell, 0, 1).build_stats);
+    print_bvh_build_stats("cornell sbvh", linear_bvh(cornell, 0, 1, sbvh_options).build_stats);
+
+    // With many small primitives the nodes are most of the memory of a scene
+    hittable_list spheres;
+    auto sphere_material = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.5, 0.5, 0.5)));
+    const size_t sphere_count = 1 << 18;
+    for (size_t i = 0; i < sphere_count; ++i)
+        spheres.add(make_shared<sphere>(vec3::random(0, 1000), 0.5, sphere_material));
+
+    // Spheres as separate objects in a BVH against the same spheres as one sphere_set
+    camera spheres_cam(vec3(-500, 1500, -500), vec3(500, 500, 500), vec3(0, 1, 0), 40, 1, 0, 10, 0.0, 1.0);
+    const auto spheres_rays = make_camera_rays(spheres_cam, width, height);
+    sphere_set sphere_batch;
+    for (const auto& object : spheres.objects)
+    {
+        auto s = std::static_pointer_cast<sphere>(object);
+        sphere_batch.add(s->center, s->radius, s->mat_ptr);
+    }
+    {
+        shared_ptr<hittable> world;
+        double build_seconds = time_seconds([&]() { world = make_shared<linear_bvh>(spheres, 0, 1); });
+        print_benchmark_row("spheres", "linear_bvh", build_seconds, benchmark_hits(*world, spheres_rays));
+        build_seconds = time_seconds([&]() { sphere_batch.build(); });
+        print_benchmark_row("spheres", "sphere_set", build_seconds, benchmark_hits(sphere_batch, spheres_rays));
+    }
+
+    auto sphere_bvh = make_shared<bvh_node>(spheres, 0, 1);
+    print_memory_row("spheres", "bvh_node", sphere_bvh->memory_bytes(), sphere_count);
+    print_memory_row("spheres", "linear_bvh", linear_bvh(spheres, 0, 1).memory_bytes(), sphere_count);
+    qbvh sphere_qbvh(sphere_bvh, 0, 1);
+    print_memory_row("spheres", "qbvh", sphere_qbvh.memory_bytes(), sphere_count);
+    print_memory_row("spheres", "compressed", compressed_bvh(sphere_qbvh).memory_bytes(), sphere_count);
+    print_memory_row("spheres", "sphere_set", sphere_batch.memory_bytes(), sphere_count);
 }
 
 int main()
 {
+    //bvh_benchmark();
+
     pi_main();
 
     return 1;
@@ -418,10 +737,13 @@ int main()
     vec3 background(Color::black);
     auto world = random_scene();
 
+    // build_cached_linear_bvh reuses the scene BVH across runs
+    const accel_builder scene_accel = build_linear_bvh;
+
     switch (10)
     {
     case 1:
-        world = random_scene();
+        world = random_scene(scene_accel);
         lookfrom = vec3(13, 2, 3);
         lookat = vec3(0, 0, 0);
         vfov = 20.0;
@@ -488,11 +810,25 @@ int main()
         break;
 
     case 10:
-        world = final_scene();
+        world = final_scene(scene_accel);
         lookfrom = vec3(478, 278, -600);
         lookat = vec3(278, 278, 0);
         vfov = 40.0;
         break;
+
+    case 11:
+        world = cornell_mesh("../models/bunny.obj");
+        lookfrom = vec3(278, 278, -800);
+        lookat = vec3(278, 278, 0);
+        vfov = 40.0;
+        break;
+
+    case 12:
+        world = cornell_cloud();
+        lookfrom = vec3(278, 278, -800);
+        lookat = vec3(278, 278, 0);
+        vfov = 40.0;
+        break;
     }
 
 
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+
+// Read only memory mapping of a whole file
+class mapped_file
+{
+	public:
+		explicit mapped_file(const std::string& path);
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		bool valid() const { return bytes != nullptr; }
+		const unsigned char* data() const { return bytes; }
+		size_t size() const { return length; }
+
+	private:
+		const unsigned char* bytes = nullptr;
+		size_t length = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#else
+		int fd = -1;
+#endif
+};
+
+#ifdef _WIN32
+mapped_file::mapped_file(const std::string& path)
+{
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		return;
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+		return;
+
+	bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (bytes)
+		length = static_cast<size_t>(file_size.QuadPart);
+}
+
+mapped_file::~mapped_file()
+{
+	if (bytes)
+		UnmapViewOfFile(bytes);
+	if (mapping)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+}
+#else
+mapped_file::mapped_file(const std::string& path)
+{
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0)
+		return;
+
+	void* p = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return;
+
+	bytes = static_cast<const unsigned char*>(p);
+	length = static_cast<size_t>(info.st_size);
+}
+
+mapped_file::~mapped_file()
+{
+	if (bytes)
+		munmap(const_cast<unsigned char*>(bytes), length);
+	if (fd >= 0)
+		close(fd);
+}
+#endif
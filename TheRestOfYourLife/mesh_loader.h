@@ -0,0 +1,720 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+/* Loaders for OBJ and PLY meshes. Files are memory mapped, cut into chunks at line (OBJ, ASCII PLY)
+   or record (binary PLY) boundaries and the chunks are parsed in parallel. Only positions, faces
+   and (OBJ) usemtl groups are read; normals and texture coordinates are skipped. Polygons are
+   split into triangle fans. */
+
+// Chunks are about this large, so there are enough of them for all cores even for small files
+const size_t mesh_chunk_bytes = 1 << 20;
+
+// Triangles and shared vertices as loaded from a file
+struct mesh_data
+{
+	std::vector<float> positions;			// x, y, z per vertex
+	std::vector<uint32_t> indices;			// 3 per triangle
+	std::vector<uint32_t> material_ids;		// per triangle, index into material_names
+	std::vector<std::string> material_names;	// material_names[0] is "", for faces without usemtl
+};
+
+
+// Number parsing on the mapped bytes, which are not null terminated
+inline const char* skip_blanks(const char* p, const char* end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		++p;
+	return p;
+}
+
+inline const char* skip_line(const char* p, const char* end)
+{
+	const void* newline = std::memchr(p, '\n', end - p);
+	return newline ? static_cast<const char*>(newline) + 1 : end;
+}
+
+template <typename T>
+inline bool parse_number(const char*& p, const char* end, T& value)
+{
+	p = skip_blanks(p, end);
+	if (p < end && *p == '+')
+		++p;
+	auto result = std::from_chars(p, end, value);
+	if (result.ec != std::errc())
+		return false;
+	p = result.ptr;
+	return true;
+}
+
+// Splits [begin, end) into pieces of about mesh_chunk_bytes, each starting at the beginning of a line
+std::vector<const char*> split_lines(const char* begin, const char* end)
+{
+	std::vector<const char*> starts = { begin };
+	const size_t size = end - begin;
+	for (size_t target = mesh_chunk_bytes; target < size; target += mesh_chunk_bytes)
+	{
+		const char* p = skip_line(begin + target, end);
+		if (p > starts.back() && p < end)
+			starts.push_back(p);
+	}
+	starts.push_back(end);
+	return starts;
+}
+
+
+// Part of an OBJ file parsed on its own. Indices cannot be resolved before all chunks are done:
+// relative (negative) ones depend on the number of vertices in the chunks before.
+struct obj_chunk
+{
+	std::vector<float> positions;
+	std::vector<int64_t> corners;				// 3 per triangle, see obj_relative_bias
+	std::vector<int32_t> face_materials;		// index into materials, -1 if the material is set in an earlier chunk
+	std::vector<std::string> materials;			// usemtl names in this chunk
+	bool valid = true;
+};
+
+// Relative indices are stored as (vertices before in this chunk + index) - bias, so they are negative and
+// absolute ones (0 based) are not
+const int64_t obj_relative_bias = int64_t(1) << 40;
+
+void parse_obj_chunk(const char* p, const char* end, obj_chunk& chunk)
+{
+	std::vector<int64_t> polygon;
+	int32_t current_material = -1;
+
+	while (p < end)
+	{
+		p = skip_blanks(p, end);
+		const char* line_end = skip_line(p, end);
+
+		if (line_end - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			float x;
+			float y;
+			float z;
+			const char* q = p + 2;
+			if (parse_number(q, line_end, x) && parse_number(q, line_end, y) && parse_number(q, line_end, z))
+			{
+				chunk.positions.push_back(x);
+				chunk.positions.push_back(y);
+				chunk.positions.push_back(z);
+			}
+			else
+			{
+				chunk.valid = false;
+			}
+		}
+		else if (line_end - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			// Vertices are "v", "v/vt", "v//vn" or "v/vt/vn", only v is used
+			polygon.clear();
+			const char* q = p + 2;
+			int64_t index;
+			while (parse_number(q, line_end, index))
+			{
+				if (index > 0)
+					polygon.push_back(index - 1);
+				else if (index < 0)
+					polygon.push_back(static_cast<int64_t>(chunk.positions.size() / 3) + index - obj_relative_bias);
+				else
+					chunk.valid = false;
+
+				while (q < line_end && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n')
+					++q;
+			}
+
+			for (size_t i = 2; i < polygon.size(); ++i)
+			{
+				chunk.corners.push_back(polygon[0]);
+				chunk.corners.push_back(polygon[i - 1]);
+				chunk.corners.push_back(polygon[i]);
+				chunk.face_materials.push_back(current_material);
+			}
+		}
+		else if (line_end - p > 7 && std::strncmp(p, "usemtl", 6) == 0 && (p[6] == ' ' || p[6] == '\t'))
+		{
+			const char* name = skip_blanks(p + 7, line_end);
+			const char* name_end = line_end;
+			while (name_end > name && (name_end[-1] == '\n' || name_end[-1] == '\r' || name_end[-1] == ' ' || name_end[-1] == '\t'))
+				--name_end;
+			current_material = static_cast<int32_t>(chunk.materials.size());
+			chunk.materials.emplace_back(name, name_end);
+		}
+
+		p = line_end;
+	}
+}
+
+// Loads the triangles of an OBJ file. Returns false if the file cannot be read or is malformed.
+bool load_obj(const std::string& path, mesh_data& mesh)
+{
+	mapped_file file(path);
+	if (!file.valid())
+	{
+		std::cerr << "Could not open " << path << ".\n";
+		return false;
+	}
+
+	const char* begin = reinterpret_cast<const char*>(file.data());
+	const std::vector<const char*> starts = split_lines(begin, begin + file.size());
+	std::vector<obj_chunk> chunks(starts.size() - 1);
+	concurrency::parallel_for(size_t(0), chunks.size(), [&](size_t c)
+	{
+		parse_obj_chunk(starts[c], starts[c + 1], chunks[c]);
+	});
+
+	// Offsets of every chunk in the merged arrays, and the material each chunk starts with
+	std::vector<size_t> vertex_offset(chunks.size() + 1, 0);
+	std::vector<size_t> triangle_offset(chunks.size() + 1, 0);
+	std::vector<std::vector<uint32_t>> material_ids(chunks.size());
+	std::unordered_map<std::string, uint32_t> material_index = { { "", 0 } };
+	mesh.material_names = { "" };
+	uint32_t current_material = 0;
+
+	for (size_t c = 0; c < chunks.size(); ++c)
+	{
+		if (!chunks[c].valid)
+		{
+			std::cerr << "Malformed line in " << path << ".\n";
+			return false;
+		}
+		vertex_offset[c + 1] = vertex_offset[c] + chunks[c].positions.size() / 3;
+		triangle_offset[c + 1] = triangle_offset[c] + chunks[c].face_materials.size();
+
+		for (const auto& name : chunks[c].materials)
+		{
+			auto inserted = material_index.emplace(name, static_cast<uint32_t>(mesh.material_names.size()));
+			if (inserted.second)
+				mesh.material_names.push_back(name);
+			material_ids[c].push_back(inserted.first->second);
+		}
+
+		// Faces before the first usemtl of a chunk keep the material of the previous chunk
+		const uint32_t inherited = current_material;
+		for (int32_t& face_material : chunks[c].face_materials)
+			face_material = face_material < 0 ? static_cast<int32_t>(inherited) : static_cast<int32_t>(material_ids[c][face_material]);
+		if (!chunks[c].face_materials.empty())
+			current_material = chunks[c].face_materials.back();
+		else if (!material_ids[c].empty())
+			current_material = material_ids[c].back();
+	}
+
+	const size_t vertex_count = vertex_offset.back();
+	if (vertex_count > UINT32_MAX)
+	{
+		std::cerr << "Too many vertices in " << path << ".\n";
+		return false;
+	}
+
+	mesh.positions.resize(3 * vertex_count);
+	mesh.indices.resize(3 * triangle_offset.back());
+	mesh.material_ids.resize(triangle_offset.back());
+
+	std::vector<char> chunk_valid(chunks.size(), 1);
+	concurrency::parallel_for(size_t(0), chunks.size(), [&](size_t c)
+	{
+		const obj_chunk& chunk = chunks[c];
+		std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + 3 * vertex_offset[c]);
+
+		for (size_t i = 0; i < chunk.corners.size(); ++i)
+		{
+			int64_t index = chunk.corners[i];
+			if (index < 0)
+				index += obj_relative_bias + static_cast<int64_t>(vertex_offset[c]);
+			if (index < 0 || index >= static_cast<int64_t>(vertex_count))
+				chunk_valid[c] = 0;
+			mesh.indices[3 * triangle_offset[c] + i] = static_cast<uint32_t>(index);
+		}
+
+		for (size_t i = 0; i < chunk.face_materials.size(); ++i)
+			mesh.material_ids[triangle_offset[c] + i] = static_cast<uint32_t>(chunk.face_materials[i]);
+	});
+
+	for (char valid : chunk_valid)
+	{
+		if (!valid)
+		{
+			std::cerr << "Vertex index out of range in " << path << ".\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Header of a PLY file: the elements with their properties
+struct ply_property
+{
+	std::string name;
+	std::string type;			// scalar type, or the item type of a list
+	std::string count_type;		// empty for scalars
+};
+
+struct ply_element
+{
+	std::string name;
+	size_t count = 0;
+	std::vector<ply_property> properties;
+};
+
+inline size_t ply_type_size(const std::string& type)
+{
+	if (type == "char" || type == "uchar" || type == "int8" || type == "uint8")
+		return 1;
+	if (type == "short" || type == "ushort" || type == "int16" || type == "uint16")
+		return 2;
+	if (type == "int" || type == "uint" || type == "int32" || type == "uint32" || type == "float" || type == "float32")
+		return 4;
+	if (type == "double" || type == "float64")
+		return 8;
+	return 0;
+}
+
+// Reads a little endian binary value of the given PLY type
+inline double read_ply_value(const unsigned char* p, const std::string& type)
+{
+	switch (type[0] == 'u' ? ply_type_size(type) + 10 : ply_type_size(type))
+	{
+		case 1: { int8_t v; std::memcpy(&v, p, 1); return v; }
+		case 11: return *p;
+		case 2: { int16_t v; std::memcpy(&v, p, 2); return v; }
+		case 12: { uint16_t v; std::memcpy(&v, p, 2); return v; }
+		case 4:
+		{
+			if (type[0] == 'f')
+			{
+				float v;
+				std::memcpy(&v, p, 4);
+				return v;
+			}
+			int32_t v;
+			std::memcpy(&v, p, 4);
+			return v;
+		}
+		case 14: { uint32_t v; std::memcpy(&v, p, 4); return v; }
+		case 8: { double v; std::memcpy(&v, p, 8); return v; }
+	}
+	return 0;
+}
+
+inline bool host_is_little_endian()
+{
+	const uint16_t one = 1;
+	unsigned char first;
+	std::memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+// Appends the triangle fan of a polygon, false if an index is out of range
+inline bool add_polygon(const std::vector<uint32_t>& polygon, size_t vertex_count, std::vector<uint32_t>& indices)
+{
+	for (uint32_t index : polygon)
+		if (index >= vertex_count)
+			return false;
+
+	for (size_t i = 2; i < polygon.size(); ++i)
+	{
+		indices.push_back(polygon[0]);
+		indices.push_back(polygon[i - 1]);
+		indices.push_back(polygon[i]);
+	}
+	return true;
+}
+
+/* Loads the triangles of a PLY file, ascii or binary little endian. Vertices need x, y and z, faces
+   a list vertex_indices (or vertex_index). Other elements and properties are skipped. */
+bool load_ply(const std::string& path, mesh_data& mesh)
+{
+	mapped_file file(path);
+	if (!file.valid())
+	{
+		std::cerr << "Could not open " << path << ".\n";
+		return false;
+	}
+
+	const char* begin = reinterpret_cast<const char*>(file.data());
+	const char* end = begin + file.size();
+
+	// Header
+	std::vector<ply_element> elements;
+	bool binary = false;
+	const char* p = begin;
+	if (end - p < 4 || std::strncmp(p, "ply", 3) != 0)
+	{
+		std::cerr << path << " is not a PLY file.\n";
+		return false;
+	}
+
+	while (true)
+	{
+		p = skip_line(p, end);
+		if (p >= end)
+		{
+			std::cerr << "No end_header in " << path << ".\n";
+			return false;
+		}
+
+		const char* line_end = skip_line(p, end);
+		std::vector<std::string> words;
+		for (const char* q = p; q < line_end;)
+		{
+			q = skip_blanks(q, line_end);
+			const char* word = q;
+			while (q < line_end && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n')
+				++q;
+			if (q > word)
+				words.emplace_back(word, q);
+			else
+				break;
+		}
+		if (words.empty())
+			continue;
+
+		if (words[0] == "end_header")
+		{
+			p = line_end;
+			break;
+		}
+		if (words[0] == "format" && words.size() > 1)
+		{
+			if (words[1] == "binary_little_endian")
+				binary = true;
+			else if (words[1] != "ascii")
+			{
+				std::cerr << "Unsupported PLY format " << words[1] << " in " << path << ".\n";
+				return false;
+			}
+		}
+		else if (words[0] == "element" && words.size() > 2)
+		{
+			ply_element element;
+			element.name = words[1];
+			element.count = std::stoull(words[2]);
+			elements.push_back(element);
+		}
+		else if (words[0] == "property" && !elements.empty())
+		{
+			ply_property property;
+			if (words.size() > 4 && words[1] == "list")
+			{
+				property.count_type = words[2];
+				property.type = words[3];
+				property.name = words[4];
+			}
+			else if (words.size() > 2)
+			{
+				property.type = words[1];
+				property.name = words[2];
+			}
+			if (ply_type_size(property.type) == 0 || (!property.count_type.empty() && ply_type_size(property.count_type) == 0))
+			{
+				std::cerr << "Unsupported PLY property type in " << path << ".\n";
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+	}
+
+	if (binary && !host_is_little_endian())
+	{
+		std::cerr << "Binary PLY files need a little endian machine.\n";
+		return false;
+	}
+
+	mesh.material_names = { "" };
+	size_t vertex_count = 0;
+
+	for (const ply_element& element : elements)
+	{
+		// Scalar properties are at fixed places within a record, lists make the records variable
+		bool fixed_size = true;
+		size_t stride = 0;
+		int axis_property[3] = { -1, -1, -1 };
+		int index_property = -1;
+		for (size_t i = 0; i < element.properties.size(); ++i)
+		{
+			const ply_property& property = element.properties[i];
+			if (!property.count_type.empty())
+			{
+				fixed_size = false;
+				if (property.name == "vertex_indices" || property.name == "vertex_index")
+					index_property = static_cast<int>(i);
+			}
+			else
+			{
+				stride += ply_type_size(property.type);
+				for (int a = 0; a < 3; ++a)
+					if (property.name == std::string(1, static_cast<char>('x' + a)))
+						axis_property[a] = static_cast<int>(i);
+			}
+		}
+
+		const bool is_vertex = element.name == "vertex";
+		const bool is_face = element.name == "face";
+		if (is_vertex && (axis_property[0] < 0 || axis_property[1] < 0 || axis_property[2] < 0 || !fixed_size))
+		{
+			std::cerr << "PLY vertices need x, y, z and no lists in " << path << ".\n";
+			return false;
+		}
+		if (is_face && index_property < 0)
+		{
+			std::cerr << "PLY faces need vertex_indices in " << path << ".\n";
+			return false;
+		}
+
+		if (binary && fixed_size)
+		{
+			if (static_cast<size_t>(end - p) < element.count * stride)
+			{
+				std::cerr << "PLY file " << path << " is truncated.\n";
+				return false;
+			}
+
+			if (is_vertex)
+			{
+				size_t axis_offset[3] = {};
+				std::string axis_type[3];
+				for (int a = 0; a < 3; ++a)
+				{
+					for (int i = 0; i < axis_property[a]; ++i)
+						axis_offset[a] += ply_type_size(element.properties[i].type);
+					axis_type[a] = element.properties[axis_property[a]].type;
+				}
+
+				vertex_count = element.count;
+				mesh.positions.resize(3 * vertex_count);
+				const unsigned char* records = reinterpret_cast<const unsigned char*>(p);
+				const size_t per_chunk = std::max<size_t>(1, mesh_chunk_bytes / std::max<size_t>(stride, 1));
+				concurrency::parallel_for(size_t(0), (vertex_count + per_chunk - 1) / per_chunk, [&](size_t c)
+				{
+					const size_t last = std::min(vertex_count, (c + 1) * per_chunk);
+					for (size_t v = c * per_chunk; v < last; ++v)
+						for (int a = 0; a < 3; ++a)
+							mesh.positions[3 * v + a] = static_cast<float>(read_ply_value(records + v * stride + axis_offset[a], axis_type[a]));
+				});
+			}
+			p += element.count * stride;
+			continue;
+		}
+
+		if (binary)
+		{
+			// Faces are read in parallel if every record is a triangle with nothing else in it,
+			// which is checked on the way. Anything else is read in one pass.
+			const unsigned char* records = reinterpret_cast<const unsigned char*>(p);
+			const unsigned char* records_end = reinterpret_cast<const unsigned char*>(end);
+			bool triangles_only = false;
+			if (is_face && element.properties.size() == 1)
+			{
+				const ply_property& list = element.properties[0];
+				const size_t count_size = ply_type_size(list.count_type);
+				const size_t index_size = ply_type_size(list.type);
+				const size_t record = count_size + 3 * index_size;
+				if (static_cast<size_t>(records_end - records) >= element.count * record)
+				{
+					std::vector<uint32_t> indices(3 * element.count);
+					std::vector<char> chunk_ok((element.count * record + mesh_chunk_bytes - 1) / mesh_chunk_bytes + 1, 1);
+					const size_t per_chunk = std::max<size_t>(1, mesh_chunk_bytes / record);
+					concurrency::parallel_for(size_t(0), (element.count + per_chunk - 1) / per_chunk, [&](size_t c)
+					{
+						const size_t last = std::min(element.count, (c + 1) * per_chunk);
+						for (size_t f = c * per_chunk; f < last; ++f)
+						{
+							const unsigned char* q = records + f * record;
+							if (read_ply_value(q, list.count_type) != 3)
+							{
+								chunk_ok[c] = 0;
+								return;
+							}
+							for (int k = 0; k < 3; ++k)
+							{
+								double index = read_ply_value(q + count_size + k * index_size, list.type);
+								if (index < 0 || index >= vertex_count)
+									chunk_ok[c] = 0;
+								indices[3 * f + k] = static_cast<uint32_t>(index);
+							}
+						}
+					});
+
+					triangles_only = std::find(chunk_ok.begin(), chunk_ok.end(), 0) == chunk_ok.end();
+					if (triangles_only)
+					{
+						mesh.indices.insert(mesh.indices.end(), indices.begin(), indices.end());
+						p += element.count * record;
+					}
+				}
+			}
+
+			if (!triangles_only)
+			{
+				std::vector<uint32_t> polygon;
+				const unsigned char* q = records;
+				for (size_t f = 0; f < element.count; ++f)
+				{
+					polygon.clear();
+					for (size_t i = 0; i < element.properties.size(); ++i)
+					{
+						const ply_property& property = element.properties[i];
+						if (property.count_type.empty())
+						{
+							q += ply_type_size(property.type);
+							continue;
+						}
+
+						const size_t count = static_cast<size_t>(read_ply_value(q, property.count_type));
+						q += ply_type_size(property.count_type);
+						if (records_end - q < static_cast<std::ptrdiff_t>(count * ply_type_size(property.type)))
+						{
+							std::cerr << "PLY file " << path << " is truncated.\n";
+							return false;
+						}
+						if (static_cast<int>(i) == index_property)
+							for (size_t k = 0; k < count; ++k)
+								polygon.push_back(static_cast<uint32_t>(read_ply_value(q + k * ply_type_size(property.type), property.type)));
+						q += count * ply_type_size(property.type);
+					}
+
+					if (is_face && !add_polygon(polygon, vertex_count, mesh.indices))
+					{
+						std::cerr << "Vertex index out of range in " << path << ".\n";
+						return false;
+					}
+				}
+				p = reinterpret_cast<const char*>(q);
+			}
+			continue;
+		}
+
+		// ASCII: one record per line. Lines are found first, then parsed in parallel chunks.
+		std::vector<const char*> lines(element.count + 1);
+		for (size_t i = 0; i < element.count; ++i)
+		{
+			if (p >= end)
+			{
+				std::cerr << "PLY file " << path << " is truncated.\n";
+				return false;
+			}
+			lines[i] = p;
+			p = skip_line(p, end);
+		}
+		lines[element.count] = p;
+
+		if (!is_vertex && !is_face)
+			continue;
+
+		const size_t lines_per_chunk = 1 << 14;
+		const size_t chunk_count = (element.count + lines_per_chunk - 1) / lines_per_chunk;
+		std::vector<std::vector<uint32_t>> chunk_indices(chunk_count);
+		std::vector<char> chunk_ok(chunk_count, 1);
+		if (is_vertex)
+		{
+			vertex_count = element.count;
+			mesh.positions.resize(3 * vertex_count);
+		}
+
+		concurrency::parallel_for(size_t(0), chunk_count, [&](size_t c)
+		{
+			std::vector<uint32_t> polygon;
+			const size_t last = std::min(element.count, (c + 1) * lines_per_chunk);
+			for (size_t l = c * lines_per_chunk; l < last; ++l)
+			{
+				const char* q = lines[l];
+				const char* line_end = lines[l + 1];
+				polygon.clear();
+				for (size_t i = 0; i < element.properties.size(); ++i)
+				{
+					const ply_property& property = element.properties[i];
+					double value;
+					if (!parse_number(q, line_end, value))
+					{
+						chunk_ok[c] = 0;
+						return;
+					}
+					if (property.count_type.empty())
+					{
+						for (int a = 0; a < 3; ++a)
+							if (is_vertex && static_cast<int>(i) == axis_property[a])
+								mesh.positions[3 * l + a] = static_cast<float>(value);
+						continue;
+					}
+
+					for (size_t k = 0; k < static_cast<size_t>(value); ++k)
+					{
+						double index;
+						if (!parse_number(q, line_end, index))
+						{
+							chunk_ok[c] = 0;
+							return;
+						}
+						if (static_cast<int>(i) == index_property)
+							polygon.push_back(static_cast<uint32_t>(index));
+					}
+				}
+
+				if (is_face && !add_polygon(polygon, vertex_count, chunk_indices[c]))
+				{
+					chunk_ok[c] = 0;
+					return;
+				}
+			}
+		});
+
+		if (std::find(chunk_ok.begin(), chunk_ok.end(), 0) != chunk_ok.end())
+		{
+			std::cerr << "Malformed " << element.name << " in " << path << ".\n";
+			return false;
+		}
+		for (const auto& indices : chunk_indices)
+			mesh.indices.insert(mesh.indices.end(), indices.begin(), indices.end());
+	}
+
+	mesh.material_ids.assign(mesh.indices.size() / 3, 0);
+	return true;
+}
+
+// Loads an .obj or .ply file
+bool load_mesh(const std::string& path, mesh_data& mesh)
+{
+	const size_t dot_position = path.find_last_of('.');
+	const std::string extension = dot_position == std::string::npos ? "" : path.substr(dot_position + 1);
+	if (extension == "obj" || extension == "OBJ")
+		return load_obj(path, mesh);
+	if (extension == "ply" || extension == "PLY")
+		return load_ply(path, mesh);
+
+	std::cerr << "Unknown mesh format " << path << ".\n";
+	return false;
+}
+
+/* Loads a mesh and builds its BVH. The OBJ usemtl names are looked up in materials, triangles
+   without a material (or with a name that is not in the map) get default_material.
+   Returns nullptr if the file could not be loaded or has no triangles. */
+shared_ptr<triangle_mesh> load_triangle_mesh(const std::string& path, shared_ptr<material> default_material,
+	const std::unordered_map<std::string, shared_ptr<material>>& materials = {})
+{
+	mesh_data mesh;
+	if (!load_mesh(path, mesh) || mesh.indices.empty())
+		return nullptr;
+
+	std::vector<shared_ptr<material>> mesh_materials;
+	for (const auto& name : mesh.material_names)
+	{
+		auto it = materials.find(name);
+		mesh_materials.push_back(it != materials.end() ? it->second : default_material);
+	}
+
+	return make_shared<triangle_mesh>(std::move(mesh.positions), std::move(mesh.indices), std::move(mesh.material_ids), std::move(mesh_materials));
+}
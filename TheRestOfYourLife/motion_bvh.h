@@ -0,0 +1,214 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Node of the motion BVH: bounds at shutter open (time0) and at shutter close (time1).
+// Layout and meaning of offset, prim_count and axis are the same as for linear_bvh_node.
+struct alignas(64) motion_bvh_node
+{
+	float bounds0_min[3];
+	float bounds0_max[3];
+	float bounds1_min[3];
+	float bounds1_max[3];
+	uint32_t offset;
+	uint16_t prim_count;
+	uint8_t axis;
+	uint8_t pad;
+	float time0;		// shutter interval, repeated per node so node_hit needs nothing else
+	float inv_duration;
+};
+
+static_assert(sizeof(motion_bvh_node) == 64, "motion_bvh_node has to fit into one cache line");
+
+// Slab test against the node bounds interpolated at the ray time. For primitives that move linearly
+// during the shutter interval, the interpolated box always contains them. Times outside the shutter
+// interval are clamped, just like the union boxes of bvh_node only cover [time0, time1].
+inline bool node_hit(const motion_bvh_node& node, const ray& r, const vec3& inv_dir, const int dir_is_neg[3], double tmin, double tmax)
+{
+	const double f = clamp((r.time() - node.time0) * node.inv_duration, 0.0, 1.0);
+	const vec3 origin = r.origin();
+	for (int a = 0; a < 3; ++a)
+	{
+		const double lo = node.bounds0_min[a] + f * (node.bounds1_min[a] - node.bounds0_min[a]);
+		const double hi = node.bounds0_max[a] + f * (node.bounds1_max[a] - node.bounds0_max[a]);
+		double t0 = (lo - origin[a]) * inv_dir[a];
+		double t1 = (hi - origin[a]) * inv_dir[a];
+		if (dir_is_neg[a])
+			std::swap(t0, t1);
+
+		tmin = t0 > tmin ? t0 : tmin;
+		tmax = t1 < tmax ? t1 : tmax;
+
+		if (tmax <= tmin)
+			return false;
+	}
+	return true;
+}
+
+
+/* Flattened BVH for scenes with moving objects. bvh_node and linear_bvh bound every moving_sphere
+   by the union of its boxes at time0 and time1, so all nodes above movers are inflated for every
+   ray time. Here each node keeps its bounds at time0 and time1 and a ray only tests the box
+   interpolated at r.time(), i.e. where the node's contents actually are at that instant.
+   The topology is the same as for linear_bvh (SAH over the union boxes), only the bounds differ.
+   Requires primitives to move linearly between time0 and time1, which holds for everything in this
+   project; objects that report their union box for every instant are bounded correctly as well. */
+class motion_bvh : public hittable
+{
+	public:
+		motion_bvh(hittable_list& list, double time0, double time1);
+
+		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, tmin, tmax, rec);
+		}
+
+		virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
+		virtual bool occluded(const ray& r, double tmin, double tmax) const;
+
+		// Recomputes the bounds at time0 and time1 bottom-up, e.g. after primitives moved
+		virtual void refit(double time0, double time1);
+
+	public:
+		std::vector<motion_bvh_node> nodes;
+		std::vector<shared_ptr<hittable>> primitives;
+		aabb box;
+};
+
+motion_bvh::motion_bvh(hittable_list& list, double time0, double time1)
+{
+	// Topology and primitive order are taken over from the flattened BVH of the union boxes
+	linear_bvh flat(list, time0, time1);
+	primitives = std::move(flat.primitives);
+	box = flat.box;
+
+	nodes.resize(flat.nodes.size());
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		motion_bvh_node& node = nodes[i];
+		node = {};
+		node.offset = flat.nodes[i].offset;
+		node.prim_count = flat.nodes[i].prim_count;
+		node.axis = flat.nodes[i].axis;
+	}
+
+	refit(time0, time1);
+}
+
+void motion_bvh::refit(double time0, double time1)
+{
+	refit_objects(primitives, time0, time1);
+
+	const float ftime0 = static_cast<float>(time0);
+	const float inv_duration = time1 > time0 ? static_cast<float>(1.0 / (time1 - time0)) : 0.0f;
+	aabb union_box;
+
+	// Children always have higher indices than their parent
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		motion_bvh_node& node = nodes[i];
+		node.time0 = ftime0;
+		node.inv_duration = inv_duration;
+
+		if (node.prim_count > 0)
+		{
+			aabb box0;
+			aabb box1;
+			for (uint32_t p = node.offset; p < node.offset + node.prim_count; ++p)
+			{
+				// Box at a single instant: for a moving_sphere just the sphere at that time
+				aabb prim_box0;
+				aabb prim_box1;
+				if (!primitives[p]->bounding_box(time0, time0, prim_box0) || !primitives[p]->bounding_box(time1, time1, prim_box1))
+					std::cerr << "No bounding box in motion_bvh constructor.\n";
+
+				if (p == node.offset)
+				{
+					box0 = prim_box0;
+					box1 = prim_box1;
+				}
+				else
+				{
+					box0.expand(prim_box0);
+					box1.expand(prim_box1);
+				}
+			}
+
+			for (int a = 0; a < 3; ++a)
+			{
+				node.bounds0_min[a] = round_down(box0.min()[a]);
+				node.bounds0_max[a] = round_up(box0.max()[a]);
+				node.bounds1_min[a] = round_down(box1.min()[a]);
+				node.bounds1_max[a] = round_up(box1.max()[a]);
+			}
+
+			if (i == 0)
+				union_box = surrounding_box(box0, box1);
+			continue;
+		}
+
+		// Interpolation is monotone, so the union of the children's bounds at both ends contains
+		// the interpolated children at every time in between
+		const motion_bvh_node& first = nodes[node.offset];
+		const motion_bvh_node& second = nodes[node.offset + 1];
+		for (int a = 0; a < 3; ++a)
+		{
+			node.bounds0_min[a] = std::min(first.bounds0_min[a], second.bounds0_min[a]);
+			node.bounds0_max[a] = std::max(first.bounds0_max[a], second.bounds0_max[a]);
+			node.bounds1_min[a] = std::min(first.bounds1_min[a], second.bounds1_min[a]);
+			node.bounds1_max[a] = std::max(first.bounds1_max[a], second.bounds1_max[a]);
+		}
+
+		if (i == 0)
+		{
+			union_box = aabb(
+				vec3(std::min(node.bounds0_min[0], node.bounds1_min[0]), std::min(node.bounds0_min[1], node.bounds1_min[1]), std::min(node.bounds0_min[2], node.bounds1_min[2])),
+				vec3(std::max(node.bounds0_max[0], node.bounds1_max[0]), std::max(node.bounds0_max[1], node.bounds1_max[1]), std::max(node.bounds0_max[2], node.bounds1_max[2])));
+		}
+	}
+
+	if (!nodes.empty())
+		box = union_box;
+}
+
+bool motion_bvh::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	output_box = box;
+	return true;
+}
+
+bool motion_bvh::intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const
+{
+	return traverse_linear_bvh(nodes.data(), r, tmin, tmax, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		bool hit_anything = false;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			if (primitives[i]->intersect(r, tmin, closest, candidate, rec))
+			{
+				hit_anything = true;
+				closest = candidate.t;
+			}
+		}
+		return hit_anything;
+	});
+}
+
+bool motion_bvh::occluded(const ray& r, double tmin, double tmax) const
+{
+	return occluded_linear_bvh(nodes.data(), r, tmin, tmax, [&](uint32_t first, uint32_t count)
+	{
+		for (uint32_t i = first; i < first + count; ++i)
+			if (primitives[i]->occluded(r, tmin, tmax))
+				return true;
+		return false;
+	});
+}
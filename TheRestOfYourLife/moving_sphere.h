@@ -2,6 +2,7 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
+#include "sphere.h"
 
 class moving_sphere : public hittable
 {
@@ -11,8 +12,19 @@ class moving_sphere : public hittable
 			: center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m)
 		{}
 
-		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, tmin, tmax, rec);
+		}
+
+		virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax) const;
+        virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const
+        {
+            return sphere_interval(center(r.time()), radius, r, t_enter, t_exit);
+        }
 
 		vec3 center(double time) const;
 
@@ -32,45 +44,27 @@ vec3 moving_sphere::center(double time) const
 	return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+// Same as sphere, with the center at the time of the ray
+bool moving_sphere::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
 {
-    vec3 oc = r.origin() - center(r.time());
-    double a = r.direction().length_squared();
-    double half_b = dot(oc, r.direction());
-    double c = oc.length_squared() - radius * radius;
-    double discriminant = half_b * half_b - a * c;
-
-    if (discriminant > 0)
-    {
-        double root = sqrt(discriminant);
+    double t;
+    if (!sphere_root(center(r.time()), radius, r, t_min, t_max, t))
+        return false;
 
-        double temp = (-half_b - root) / a;
-        if (temp < t_max && temp > t_min)
-        {
-            rec.t = temp;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center(r.time())) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+    candidate.t = t;
+    candidate.object = this;
+    return true;
+}
 
-            // get uv coordinates (expects things on the unit sphere (divided by radius) centered at the origin (minus center))
-            get_sphere_uv((rec.p - center(r.time())) / radius, rec.u, rec.v);
-            return true;
-        }
+void moving_sphere::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+    sphere_surface(r, candidate.t, center(r.time()), radius, mat_ptr, rec);
+}
 
-        temp = (-half_b + root) / a;
-        if (temp < t_max && temp > t_min)
-        {
-            rec.t = temp;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center(r.time())) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.p - center(r.time())) / radius, rec.u, rec.v);
-            return true;
-        }
-    }
-    return false;
+bool moving_sphere::occluded(const ray& r, double t_min, double t_max) const
+{
+    double t;
+    return sphere_root(center(r.time()), radius, r, t_min, t_max, t);
 }
 
 // For moving sphere, we can take the box of the sphere at time0, and the box of the sphere at time1,
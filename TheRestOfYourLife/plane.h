@@ -0,0 +1,86 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+
+
+/* Infinite plane through point with the given normal, e.g. as ground instead of a huge sphere.
+   It has no bounding box, so it must not be put into a BVH. scene keeps it in its list of large
+   objects that are tested separately. */
+class plane : public hittable
+{
+	public:
+		plane(const vec3& point, const vec3& normal, shared_ptr<material> mat);
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const;
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			return false;
+		}
+
+	private:
+		vec3 p0;
+		vec3 n;
+		// Orthonormal basis of the plane for the texture coordinates
+		vec3 tangent;
+		vec3 bitangent;
+		shared_ptr<material> mat_ptr;
+};
+
+plane::plane(const vec3& point, const vec3& normal, shared_ptr<material> mat)
+	: p0(point), n(unit_vector(normal)), mat_ptr(mat)
+{
+	vec3 a = std::abs(n.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	tangent = unit_vector(cross(a, n));
+	bitangent = cross(n, tangent);
+}
+
+// Ray equation inserted into the plane equation dot(p - p0, n) = 0 gives t directly
+bool plane::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	double denom = dot(r.direction(), n);
+	if (std::abs(denom) < 1e-12)
+		return false;
+
+	double t = dot(p0 - r.origin(), n) / denom;
+	if (t < t_min || t > t_max)
+		return false;
+
+	candidate.t = t;
+	candidate.object = this;
+	return true;
+}
+
+void plane::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+	rec.t = candidate.t;
+	rec.p = r.at(rec.t);
+
+	// Texture coordinates repeat every unit along the plane
+	vec3 d = rec.p - p0;
+	double u = dot(d, tangent);
+	double v = dot(d, bitangent);
+	rec.u = u - std::floor(u);
+	rec.v = v - std::floor(v);
+
+	rec.set_face_normal(r, n);
+	rec.mat_ptr = mat_ptr;
+}
+
+bool plane::occluded(const ray& r, double t_min, double t_max) const
+{
+	double denom = dot(r.direction(), n);
+	if (std::abs(denom) < 1e-12)
+		return false;
+
+	double t = dot(p0 - r.origin(), n) / denom;
+	return t >= t_min && t <= t_max;
+}
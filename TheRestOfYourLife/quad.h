@@ -0,0 +1,133 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+
+
+/* Planar quad (parallelogram) Q + a * u + b * v with a, b in [0, 1]. The plane offset and the inverse
+   basis of u, v are precomputed, so a hit costs the ray / plane distance and two dot products for the
+   coordinates a, b of the hit point, which are also its uv. The outward normal is unit(cross(u, v)).
+   A quad whose normal is a coordinate axis takes t from that one coordinate of the ray instead of
+   two dot products; the axis aligned rects are such quads. */
+class quad : public hittable
+{
+	public:
+		quad(const vec3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat)
+			: quad(Q, u, v, unit_vector(cross(u, v)), mat)
+		{}
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const;
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = box;
+			return true;
+		}
+
+	protected:
+		// normal must be parallel to cross(u, v), its sign only decides which side is the front face
+		quad(const vec3& Q, const vec3& u, const vec3& v, const vec3& normal, shared_ptr<material> mat);
+
+	private:
+		// Distance to the plane and coordinates of the hit point in the basis u, v
+		bool plane_hit(const ray& r, double t_min, double t_max, double& t, double& a, double& b) const;
+
+	private:
+		vec3 Q;
+		vec3 normal;
+		vec3 a_axis;	// cross(v, w), a = dot(p - Q, a_axis)
+		vec3 b_axis;	// cross(w, u), b = dot(p - Q, b_axis)
+		double D;		// Plane offset, dot(normal, p) = D for points on the plane
+		int axis;		// Coordinate axis the normal points along, -1 for a general quad
+		shared_ptr<material> mat_ptr;
+		aabb box;
+};
+
+quad::quad(const vec3& _Q, const vec3& u, const vec3& v, const vec3& _normal, shared_ptr<material> mat)
+	: Q(_Q), normal(_normal), mat_ptr(mat)
+{
+	// With w = n / dot(n, n) the coordinates of a point p in the plane are a = dot(w, cross(p - Q, v))
+	// and b = dot(w, cross(u, p - Q)), both rewritten as one dot product with p - Q
+	const vec3 n = cross(u, v);
+	const vec3 w = n / dot(n, n);
+	a_axis = cross(v, w);
+	b_axis = cross(w, u);
+	D = dot(normal, Q);
+
+	axis = -1;
+	for (int i = 0; i < 3; ++i)
+		if (normal[(i + 1) % 3] == 0 && normal[(i + 2) % 3] == 0)
+			axis = i;
+
+	// Thin boxes, as for the rects before, so the BVH slab test does not miss the quad at grazing angles
+	vec3 lo;
+	vec3 hi;
+	for (int i = 0; i < 3; ++i)
+	{
+		lo[i] = std::min({ Q[i], Q[i] + u[i], Q[i] + v[i], Q[i] + u[i] + v[i] });
+		hi[i] = std::max({ Q[i], Q[i] + u[i], Q[i] + v[i], Q[i] + u[i] + v[i] });
+		if (hi[i] - lo[i] < 0.0002)
+		{
+			lo[i] -= 0.0001;
+			hi[i] += 0.0001;
+		}
+	}
+	box = aabb(lo, hi);
+}
+
+// A ray parallel to the plane gets an infinite or NaN t, which the range tests reject
+bool quad::plane_hit(const ray& r, double t_min, double t_max, double& t, double& a, double& b) const
+{
+	if (axis >= 0)
+		t = (Q[axis] - r.origin()[axis]) / r.direction()[axis];
+	else
+		t = (D - dot(normal, r.origin())) / dot(normal, r.direction());
+
+	if (!(t >= t_min && t <= t_max))
+		return false;
+
+	const vec3 planar = r.at(t) - Q;
+	a = dot(planar, a_axis);
+	b = dot(planar, b_axis);
+	return a >= 0 && a <= 1 && b >= 0 && b <= 1;
+}
+
+bool quad::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	double t;
+	double a;
+	double b;
+	if (!plane_hit(r, t_min, t_max, t, a, b))
+		return false;
+
+	candidate.t = t;
+	candidate.object = this;
+	candidate.u = a;
+	candidate.v = b;
+	return true;
+}
+
+void quad::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+	rec.u = candidate.u;
+	rec.v = candidate.v;
+	rec.t = candidate.t;
+	rec.set_face_normal(r, normal);
+	rec.mat_ptr = mat_ptr;
+	rec.p = r.at(candidate.t);
+}
+
+bool quad::occluded(const ray& r, double t_min, double t_max) const
+{
+	double t;
+	double a;
+	double b;
+	return plane_hit(r, t_min, t_max, t, a, b);
+}
@@ -6,19 +6,19 @@
 class ray
 {
     public:
-        ray() {}
-        ray(const vec3& origin, const vec3& direction)
+        constexpr ray() : tm(0) {}
+        constexpr ray(const vec3& origin, const vec3& direction)
             : orig(origin), dir(direction), tm(0)
         {}
 
-        ray(const vec3& origin, const vec3& direction, double time)
+        constexpr ray(const vec3& origin, const vec3& direction, double time)
             : orig(origin), dir(direction), tm(time)
         {}
 
-        vec3 origin() const { return orig; }
-        vec3 direction() const { return dir; }
-        double time() const { return tm; }
-        vec3 at(double t) const { return orig + t*dir; }
+        constexpr vec3 origin() const { return orig; }
+        constexpr vec3 direction() const { return dir; }
+        constexpr double time() const { return tm; }
+        constexpr vec3 at(double t) const { return orig + t*dir; }
 
         vec3 orig;
         vec3 dir;
@@ -15,14 +15,14 @@ using std::make_shared;
 
 // Constants
 
-const double infinity = std::numeric_limits<double>::infinity();
-const double pi = 3.1415926535897932385;
-const double epsilon = 0.001;
+constexpr double infinity = std::numeric_limits<double>::infinity();
+constexpr double pi = 3.1415926535897932385;
+constexpr double epsilon = 0.001;
 
 
 // Utility Functions
 
-inline double degrees_to_radians(double degrees)
+constexpr double degrees_to_radians(double degrees)
 {
 	return degrees * pi / 180.0;
 }
@@ -45,22 +45,84 @@ inline int random_int(int min, int max)
 	return static_cast<int>(random_double(min, max + 1));
 }
 
-inline double min(double a, double b)
+constexpr double min(double a, double b)
 { 
 	return a <= b ? a : b; 
 }
 
-inline double max(double a, double b)
+constexpr double max(double a, double b)
 { 
 	return a >= b ? a : b; 
 }
 
-inline double clamp(double x, double min, double max) {
+constexpr double clamp(double x, double min, double max) {
 	if (x < min) return min;
 	if (x > max) return max;
 	return x;
 }
 
+
+// Compile-time Math
+// std::sqrt / sin / cos / tan are not constexpr, so scene constants that are known at compile time
+// (Cornell walls, box rotations, camera basis) use these instead. Not meant for the per-ray hot path.
+
+// Newton iteration, stops as soon as the estimate no longer changes.
+constexpr double constexpr_sqrt(double x)
+{
+	if (x < 0 || x != x)
+		return std::numeric_limits<double>::quiet_NaN();
+	if (x == 0 || x == infinity)
+		return x;
+
+	double curr = x < 1 ? 1 : x;
+	double prev = 0;
+	while (curr != prev)
+	{
+		prev = curr;
+		curr = 0.5 * (curr + x / curr);
+		// Newton may oscillate between two neighbouring doubles, take the smaller one then.
+		if (curr > prev && prev * prev >= x)
+			return prev;
+	}
+	return curr;
+}
+
+// Taylor series after reducing the angle to [-pi, pi]. Converges to full double precision in ~30 terms.
+constexpr double constexpr_sin(double x)
+{
+	while (x > pi) x -= 2 * pi;
+	while (x < -pi) x += 2 * pi;
+
+	double term = x;
+	double sum = x;
+	for (int n = 1; n < 30; ++n)
+	{
+		term *= -x * x / ((2 * n) * (2 * n + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+constexpr double constexpr_cos(double x)
+{
+	while (x > pi) x -= 2 * pi;
+	while (x < -pi) x += 2 * pi;
+
+	double term = 1;
+	double sum = 1;
+	for (int n = 1; n < 30; ++n)
+	{
+		term *= -x * x / ((2 * n - 1) * (2 * n));
+		sum += term;
+	}
+	return sum;
+}
+
+constexpr double constexpr_tan(double x)
+{
+	return constexpr_sin(x) / constexpr_cos(x);
+}
+
 #include "ray.h"
 #include "vec3.h"
 
@@ -69,5 +131,5 @@ inline double clamp(double x, double min, double max) {
 
 namespace Color
 {
-	const vec3 black = vec3(0, 0, 0);
+	constexpr vec3 black = vec3(0, 0, 0);
 }
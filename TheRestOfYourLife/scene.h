@@ -0,0 +1,217 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <functional>
+#include <vector>
+
+
+// Builds the acceleration structure over a list of objects. Scenes take it as parameter,
+// so the BVH variants can be compared on exactly the same geometry.
+using accel_builder = std::function<shared_ptr<hittable>(hittable_list&, double, double)>;
+
+// Objects whose box diagonal is longer than this fraction of the scene's diagonal are not put into the BVH
+const double scene_large_object_fraction = 0.25;
+
+
+/* Homogeneous fog filling the scene, or a sphere around it. The scene samples the scattering distance
+   analytically on the part of each ray in front of the closest surface, so the fog needs no boundary
+   object, is never put into the BVH and costs one random number per ray. */
+class homogeneous_fog
+{
+	public:
+		homogeneous_fog(double density, shared_ptr<texture> a, const vec3& c = vec3(0, 0, 0), double r = infinity)
+			: neg_inv_density(-1 / density), center(c), radius(r)
+		{
+			phase_function = make_shared<isotropic>(a);
+		}
+
+		// Distance t in [t_min, t_max) where the ray scatters, false if it passes the fog up to t_max
+		bool sample(const ray& r, double t_min, double t_max, double& t) const;
+
+		void surface_interaction(const ray& r, double t, hit_record& rec) const;
+
+	private:
+		double neg_inv_density;
+		shared_ptr<material> phase_function;
+		vec3 center;
+		double radius;	// infinity for fog without bounds
+};
+
+bool homogeneous_fog::sample(const ray& r, double t_min, double t_max, double& t) const
+{
+	double t_enter = -infinity;
+	double t_exit = infinity;
+	if (radius < infinity && !sphere_interval(center, radius, r, t_enter, t_exit))
+		return false;
+
+	t_enter = std::max(t_enter, t_min);
+	t_exit = std::min(t_exit, t_max);
+	if (t_enter >= t_exit)
+		return false;
+
+	// Same exponential free flight as constant_medium, converted from length to t
+	t = t_enter + neg_inv_density * log(random_double()) / r.direction().length();
+	return t < t_exit;
+}
+
+void homogeneous_fog::surface_interaction(const ray& r, double t, hit_record& rec) const
+{
+	rec.t = t;
+	rec.p = r.at(t);
+	rec.normal = vec3(1, 0, 0); // arbitrary
+	rec.front_face = true;		// also arbitrary
+	rec.mat_ptr = phase_function;
+}
+
+
+/* Top level of a scene: a BVH over all regular objects plus a short list of large objects that are
+   tested one by one. Unbounded objects (planes) cannot be in a BVH at all, and huge ones (a ground
+   sphere of radius 1000) would overlap every node next to objects of radius 0.2, so every ray would
+   have to visit most of the tree. Both are sorted out automatically when the scene is built, and
+   chains of transform wrappers around objects are folded into single instances (fold_transforms()).
+   Fog around everything is not an object at all but the scene's fog, see homogeneous_fog. */
+class scene : public hittable
+{
+	public:
+		scene(hittable_list& objects, double time0, double time1, const accel_builder& build_accel,
+			double large_object_fraction = scene_large_object_fraction);
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+
+		// Only reached for scatter events in the fog, surfaces have their own candidates
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+		{
+			fog->surface_interaction(r, candidate.t, rec);
+		}
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
+
+		// Large objects first: a ground plane blocks many shadow rays without traversing the BVH.
+		// Fog blocks the ray with the probability that it scatters before t_max.
+		virtual bool occluded(const ray& r, double t_min, double t_max) const
+		{
+			double t;
+			return large_objects.occluded(r, t_min, t_max) || (accel && accel->occluded(r, t_min, t_max))
+				|| (fog && fog->sample(r, t_min, t_max, t));
+		}
+
+		virtual void refit(double time0, double time1)
+		{
+			large_objects.refit(time0, time1);
+			if (accel)
+				accel->refit(time0, time1);
+		}
+
+	public:
+		hittable_list large_objects;	// unbounded or too large for the BVH
+		shared_ptr<hittable> accel;		// BVH over everything else, nullptr if there is nothing else
+		shared_ptr<homogeneous_fog> fog;	// nullptr for a scene without fog
+};
+
+scene::scene(hittable_list& objects, double time0, double time1, const accel_builder& build_accel, double large_object_fraction)
+{
+	const size_t count = objects.objects.size();
+
+	std::vector<shared_ptr<hittable>> folded(count);
+	for (size_t i = 0; i < count; ++i)
+		folded[i] = fold_transforms(objects.objects[i]);
+
+	// Boxes are needed several times (extent of the scene, then size of each object), so they are gathered once
+	std::vector<aabb> boxes(count);
+	std::vector<bool> large(count);
+	for (size_t i = 0; i < count; ++i)
+		large[i] = !folded[i]->bounding_box(time0, time1, boxes[i]);
+
+	// A single huge object (a fog sphere around everything) dominates the extent of the scene and would
+	// hide the other large ones, so the extent is computed a second time without the first pass' objects.
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		aabb scene_box;
+		bool has_box = false;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (large[i])
+				continue;
+			if (has_box)
+				scene_box.expand(boxes[i]);
+			else
+				scene_box = boxes[i];
+			has_box = true;
+		}
+		if (!has_box)
+			break;
+
+		const double max_diagonal = large_object_fraction * (scene_box.max() - scene_box.min()).length();
+		for (size_t i = 0; i < count; ++i)
+			if (!large[i] && (boxes[i].max() - boxes[i].min()).length() > max_diagonal)
+				large[i] = true;
+	}
+
+	hittable_list regular_objects;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (large[i])
+			large_objects.add(folded[i]);
+		else
+			regular_objects.add(folded[i]);
+	}
+
+	if (!regular_objects.objects.empty())
+		accel = build_accel(regular_objects, time0, time1);
+}
+
+bool scene::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	// Large objects first: the hit on a ground plane is an upper bound that prunes the BVH traversal
+	bool hit_anything = large_objects.intersect(r, t_min, t_max, candidate, rec);
+	if (hit_anything)
+		t_max = candidate.t;
+
+	if (accel && accel->intersect(r, t_min, t_max, candidate, rec))
+	{
+		hit_anything = true;
+		t_max = candidate.t;
+	}
+
+	// The ray scatters in the fog if that happens in front of the closest surface
+	double t_fog;
+	if (fog && fog->sample(r, t_min, t_max, t_fog))
+	{
+		candidate.t = t_fog;
+		candidate.object = this;
+		return true;
+	}
+
+	return hit_anything;
+}
+
+bool scene::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	aabb accel_box;
+	if (accel && !accel->bounding_box(time0, time1, accel_box))
+		return false;
+
+	if (large_objects.objects.empty())
+	{
+		output_box = accel_box;
+		return accel != nullptr;
+	}
+
+	aabb large_box;
+	if (!large_objects.bounding_box(time0, time1, large_box))
+		return false;
+
+	output_box = accel ? surrounding_box(accel_box, large_box) : large_box;
+	return true;
+}
@@ -4,6 +4,25 @@
 #include "hittable.h"
 
 
+// Both roots of the sphere equation, i.e. where the line of the ray enters and leaves the sphere
+inline bool sphere_interval(const vec3& center, double radius, const ray& r, double& t_enter, double& t_exit)
+{
+    vec3 oc = r.origin() - center;
+    double a = r.direction().length_squared();
+    double half_b = dot(oc, r.direction());
+    double c = oc.length_squared() - radius*radius;
+    double discriminant = half_b * half_b - a*c;
+
+    if (discriminant <= 0)
+        return false;
+
+    double root = sqrt(discriminant);
+    t_enter = (-half_b - root) / a;
+    t_exit = (-half_b + root) / a;
+    return true;
+}
+
+
 class sphere : public hittable 
 {
     public:
@@ -11,8 +30,19 @@ class sphere : public hittable
         sphere(vec3 cen, double r, shared_ptr<material> m) 
             :   center(cen), radius(r), mat_ptr(m) {}
 
-        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+        {
+            return hit_deferred(*this, r, tmin, tmax, rec);
+        }
+
+        virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+        virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time01, aabb& output_box) const;
+        virtual bool occluded(const ray& r, double tmin, double tmax) const;
+        virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const
+        {
+            return sphere_interval(center, radius, r, t_enter, t_exit);
+        }
 
         vec3 center;
         double radius;
@@ -20,7 +50,8 @@ class sphere : public hittable
 };
 
 // Sphere hit function derived from sphere equation + solving a quadratic equation with known formulas...
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const 
+// Returns the closer root within (t_min, t_max).
+inline bool sphere_root(const vec3& center, double radius, const ray& r, double t_min, double t_max, double& t)
 {
     vec3 oc = r.origin() - center;
     double a = r.direction().length_squared();
@@ -28,37 +59,52 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     double c = oc.length_squared() - radius*radius;
     double discriminant = half_b * half_b - a*c;
 
-    if (discriminant > 0) 
-    {
-        double root = sqrt(discriminant);
+    if (discriminant <= 0)
+        return false;
 
-        double temp = (-half_b - root) / a;
-        if (temp < t_max && temp > t_min) 
-        {
-            rec.t = temp;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-
-            // get uv coordinates (expects things on the unit sphere (divided by radius) centered at the origin (minus center))
-            get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
-            return true;
-        }
+    double root = sqrt(discriminant);
+    t = (-half_b - root) / a;
+    if (t < t_max && t > t_min)
+        return true;
 
-        temp = (-half_b + root) / a;
-        if (temp < t_max && temp > t_min) 
-        {
-            rec.t = temp;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
-            return true;
-        }
-    }
-    return false;
+    t = (-half_b + root) / a;
+    return t < t_max && t > t_min;
+}
+
+// Hit record of a sphere hit at t, shared by all sphere primitives
+inline void sphere_surface(const ray& r, double t, const vec3& center, double radius, const shared_ptr<material>& mat_ptr, hit_record& rec)
+{
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr;
+
+    // get uv coordinates (expects things on the unit sphere (divided by radius) centered at the origin (minus center))
+    get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+}
+
+bool sphere::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+    double t;
+    if (!sphere_root(center, radius, r, t_min, t_max, t))
+        return false;
+
+    candidate.t = t;
+    candidate.object = this;
+    return true;
+}
+
+void sphere::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+    sphere_surface(r, candidate.t, center, radius, mat_ptr, rec);
+}
+
+// Same quadratic as hit, but only checks whether one of the roots lies in (t_min, t_max)
+bool sphere::occluded(const ray& r, double t_min, double t_max) const
+{
+    double t;
+    return sphere_root(center, radius, r, t_min, t_max, t);
 }
 
 // This sphere does not move over time, so time variables can be ignored
@@ -0,0 +1,400 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "bvh_builder.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+// Spheres tested together in one leaf of a sphere_set
+const int sphere_block_width = 8;
+
+// Centers and radii of up to 8 spheres in float precision, one array per coordinate, so one AVX
+// register holds the same value of all spheres. extent (|x| + |y| + |z| + radius, rounded up) bounds
+// the rounding error of the float test.
+struct alignas(32) sphere_block
+{
+	float center[3][sphere_block_width];
+	float radius[sphere_block_width];
+	float extent[sphere_block_width];
+};
+
+// Relative error allowed for the float test, far above the few ulps it actually makes
+const float sphere_block_tolerance = 1e-5f;
+
+// Ray in float precision for the block test
+struct sphere_block_ray
+{
+	float origin[3];
+	float dir[3];
+	float inv_length_squared;
+	float inv_length;
+	float origin_extent;	// |x| + |y| + |z| of the origin
+};
+
+inline sphere_block_ray make_sphere_block_ray(const ray& r)
+{
+	sphere_block_ray sr;
+	double length_squared = r.direction().length_squared();
+	sr.origin_extent = 0;
+	for (int a = 0; a < 3; ++a)
+	{
+		sr.origin[a] = static_cast<float>(r.origin()[a]);
+		sr.dir[a] = static_cast<float>(r.direction()[a]);
+		sr.origin_extent += std::abs(sr.origin[a]);
+	}
+	sr.inv_length_squared = static_cast<float>(1.0 / length_squared);
+	sr.inv_length = static_cast<float>(1.0 / std::sqrt(length_squared));
+	return sr;
+}
+
+/* Conservative float test of a ray against the spheres of a block: Returns a bit mask of the spheres
+   the ray may hit within (tmin, tmax). The radius is enlarged by the tolerance, so no sphere the
+   double precision test hits is missed, and the few extra candidates are sorted out by the exact test.
+   The distance of the center to the ray is computed from the closest point on the ray instead of the
+   discriminant b^2 - ac, which loses all precision in float for spheres far from the origin. */
+inline int sphere_block_hit(const sphere_block& block, const sphere_block_ray& r, float tmin, float tmax)
+{
+	int mask = 0;
+	for (int i = 0; i < sphere_block_width; ++i)
+	{
+		const float ox = block.center[0][i] - r.origin[0];
+		const float oy = block.center[1][i] - r.origin[1];
+		const float oz = block.center[2][i] - r.origin[2];
+		const float tc = (ox * r.dir[0] + oy * r.dir[1] + oz * r.dir[2]) * r.inv_length_squared;
+		const float lx = ox - tc * r.dir[0];
+		const float ly = oy - tc * r.dir[1];
+		const float lz = oz - tc * r.dir[2];
+		const float radius = block.radius[i] + sphere_block_tolerance * (block.extent[i] + r.origin_extent);
+		const float h2 = radius * radius - (lx * lx + ly * ly + lz * lz);
+		const float h = std::sqrt(h2 > 0 ? h2 : 0) * r.inv_length;
+		if (h2 >= 0 && tc + h > tmin && tc - h < tmax)
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+#if defined(WIDE_BVH_AVX)
+// All 8 spheres in one AVX register
+inline int sphere_block_hit_simd(const sphere_block& block, const sphere_block_ray& r, float tmin, float tmax)
+{
+	const __m256 ox = _mm256_sub_ps(_mm256_load_ps(block.center[0]), _mm256_set1_ps(r.origin[0]));
+	const __m256 oy = _mm256_sub_ps(_mm256_load_ps(block.center[1]), _mm256_set1_ps(r.origin[1]));
+	const __m256 oz = _mm256_sub_ps(_mm256_load_ps(block.center[2]), _mm256_set1_ps(r.origin[2]));
+	const __m256 dx = _mm256_set1_ps(r.dir[0]);
+	const __m256 dy = _mm256_set1_ps(r.dir[1]);
+	const __m256 dz = _mm256_set1_ps(r.dir[2]);
+
+	const __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ox, dx), _mm256_mul_ps(oy, dy)), _mm256_mul_ps(oz, dz));
+	const __m256 tc = _mm256_mul_ps(b, _mm256_set1_ps(r.inv_length_squared));
+	const __m256 lx = _mm256_sub_ps(ox, _mm256_mul_ps(tc, dx));
+	const __m256 ly = _mm256_sub_ps(oy, _mm256_mul_ps(tc, dy));
+	const __m256 lz = _mm256_sub_ps(oz, _mm256_mul_ps(tc, dz));
+	const __m256 distance2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+
+	const __m256 tolerance = _mm256_mul_ps(_mm256_set1_ps(sphere_block_tolerance),
+		_mm256_add_ps(_mm256_load_ps(block.extent), _mm256_set1_ps(r.origin_extent)));
+	const __m256 radius = _mm256_add_ps(_mm256_load_ps(block.radius), tolerance);
+	const __m256 h2 = _mm256_sub_ps(_mm256_mul_ps(radius, radius), distance2);
+	const __m256 h = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_max_ps(h2, _mm256_setzero_ps())), _mm256_set1_ps(r.inv_length));
+
+	__m256 candidate = _mm256_cmp_ps(h2, _mm256_setzero_ps(), _CMP_GE_OQ);
+	candidate = _mm256_and_ps(candidate, _mm256_cmp_ps(_mm256_add_ps(tc, h), _mm256_set1_ps(tmin), _CMP_GT_OQ));
+	candidate = _mm256_and_ps(candidate, _mm256_cmp_ps(_mm256_sub_ps(tc, h), _mm256_set1_ps(tmax), _CMP_LT_OQ));
+	return _mm256_movemask_ps(candidate);
+}
+#elif defined(WIDE_BVH_SSE)
+// Two halves of 4 spheres in SSE registers
+inline int sphere_block_hit_simd(const sphere_block& block, const sphere_block_ray& r, float tmin, float tmax)
+{
+	int mask = 0;
+	for (int half = 0; half < sphere_block_width; half += 4)
+	{
+		const __m128 ox = _mm_sub_ps(_mm_load_ps(block.center[0] + half), _mm_set1_ps(r.origin[0]));
+		const __m128 oy = _mm_sub_ps(_mm_load_ps(block.center[1] + half), _mm_set1_ps(r.origin[1]));
+		const __m128 oz = _mm_sub_ps(_mm_load_ps(block.center[2] + half), _mm_set1_ps(r.origin[2]));
+		const __m128 dx = _mm_set1_ps(r.dir[0]);
+		const __m128 dy = _mm_set1_ps(r.dir[1]);
+		const __m128 dz = _mm_set1_ps(r.dir[2]);
+
+		const __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ox, dx), _mm_mul_ps(oy, dy)), _mm_mul_ps(oz, dz));
+		const __m128 tc = _mm_mul_ps(b, _mm_set1_ps(r.inv_length_squared));
+		const __m128 lx = _mm_sub_ps(ox, _mm_mul_ps(tc, dx));
+		const __m128 ly = _mm_sub_ps(oy, _mm_mul_ps(tc, dy));
+		const __m128 lz = _mm_sub_ps(oz, _mm_mul_ps(tc, dz));
+		const __m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+
+		const __m128 tolerance = _mm_mul_ps(_mm_set1_ps(sphere_block_tolerance),
+			_mm_add_ps(_mm_load_ps(block.extent + half), _mm_set1_ps(r.origin_extent)));
+		const __m128 radius = _mm_add_ps(_mm_load_ps(block.radius + half), tolerance);
+		const __m128 h2 = _mm_sub_ps(_mm_mul_ps(radius, radius), distance2);
+		const __m128 h = _mm_mul_ps(_mm_sqrt_ps(_mm_max_ps(h2, _mm_setzero_ps())), _mm_set1_ps(r.inv_length));
+
+		__m128 candidate = _mm_cmpge_ps(h2, _mm_setzero_ps());
+		candidate = _mm_and_ps(candidate, _mm_cmpgt_ps(_mm_add_ps(tc, h), _mm_set1_ps(tmin)));
+		candidate = _mm_and_ps(candidate, _mm_cmplt_ps(_mm_sub_ps(tc, h), _mm_set1_ps(tmax)));
+		mask |= _mm_movemask_ps(candidate) << half;
+	}
+	return mask;
+}
+#else
+inline int sphere_block_hit_simd(const sphere_block& block, const sphere_block_ray& r, float tmin, float tmax)
+{
+	return sphere_block_hit(block, r, tmin, tmax);
+}
+#endif
+
+/* Many static spheres as one primitive. Centers, radii and material ids are stored as arrays
+   instead of one sphere object (and allocation) per sphere. The set builds its own BVH, whose
+   leaves hold up to 8 spheres in one sphere_block: a leaf is tested with one SIMD pass of the
+   conservative float test, and only the candidates it returns are tested exactly.
+   Spheres are added with add(), then build() creates the BVH; adding more and building again
+   rebuilds it over all of them. Hits give the same results as the same spheres as sphere objects. */
+class sphere_set : public hittable
+{
+	public:
+		sphere_set() {}
+
+		void add(const vec3& center, double radius, shared_ptr<material> m);
+		void build();
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = box;
+			return !nodes.empty();
+		}
+
+		size_t size() const { return centers.size(); }
+
+		// Bytes of the sphere arrays, blocks and BVH nodes
+		size_t memory_bytes() const
+		{
+			return (centers.size() + leaf_centers.size()) * sizeof(vec3) + (radii.size() + leaf_radii.size()) * sizeof(double)
+				+ (material_ids.size() + leaf_material_ids.size()) * sizeof(uint32_t) + blocks.size() * sizeof(sphere_block) + nodes.size() * sizeof(linear_bvh_node)
+				+ materials.size() * sizeof(shared_ptr<material>);
+		}
+
+	public:
+		// Spheres in the order they were added
+		std::vector<vec3> centers;
+		std::vector<double> radii;
+		std::vector<uint32_t> material_ids;
+		std::vector<shared_ptr<material>> materials;
+
+		// Exact values in leaf order written by build(), each leaf starts at a multiple of 8
+		std::vector<vec3> leaf_centers;
+		std::vector<double> leaf_radii;
+		std::vector<uint32_t> leaf_material_ids;
+
+		std::vector<sphere_block, cache_aligned_allocator<sphere_block>> blocks;
+		linear_bvh_nodes nodes;		// leaves: offset is the block, prim_count the number of spheres in it
+		aabb box;
+
+	private:
+		uint32_t subtree_size(const bvh_build_result& result, uint32_t build_index, std::vector<uint32_t>& sizes) const;
+		void gather(const bvh_build_result& result, uint32_t build_index, std::vector<uint32_t>& order) const;
+		void flatten(const bvh_build_result& result, uint32_t build_index, size_t index, const std::vector<uint32_t>& sizes,
+			std::vector<uint32_t>& order);
+
+	private:
+		std::unordered_map<const material*, uint32_t> material_index;
+};
+
+void sphere_set::add(const vec3& center, double radius, shared_ptr<material> m)
+{
+	auto inserted = material_index.emplace(m.get(), static_cast<uint32_t>(materials.size()));
+	if (inserted.second)
+		materials.push_back(m);
+
+	centers.push_back(center);
+	radii.push_back(radius);
+	material_ids.push_back(inserted.first->second);
+}
+
+uint32_t sphere_set::subtree_size(const bvh_build_result& result, uint32_t build_index, std::vector<uint32_t>& sizes) const
+{
+	const bvh_build_node& node = result.nodes[build_index];
+	sizes[build_index] = node.count > 0 ? node.count
+		: subtree_size(result, node.first, sizes) + subtree_size(result, node.second, sizes);
+	return sizes[build_index];
+}
+
+void sphere_set::gather(const bvh_build_result& result, uint32_t build_index, std::vector<uint32_t>& order) const
+{
+	const bvh_build_node& node = result.nodes[build_index];
+	if (node.count > 0)
+	{
+		for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			order.push_back(result.primitives[i].index);
+		return;
+	}
+	gather(result, node.first, order);
+	gather(result, node.second, order);
+}
+
+// Same layout as linear_bvh (sibling pairs, nodes[1] repeats the root). Subtrees with up to 8 spheres
+// become one leaf, their spheres are appended to order padded to a full block.
+void sphere_set::flatten(const bvh_build_result& result, uint32_t build_index, size_t index, const std::vector<uint32_t>& sizes,
+	std::vector<uint32_t>& order)
+{
+	const bvh_build_node& node = result.nodes[build_index];
+	linear_bvh_node flat = {};
+	set_node_bounds(flat, node.box);
+
+	if (sizes[build_index] <= sphere_block_width)
+	{
+		flat.offset = static_cast<uint32_t>(order.size() / sphere_block_width);
+		flat.prim_count = static_cast<uint16_t>(sizes[build_index]);
+		gather(result, build_index, order);
+		order.resize(order.size() + sphere_block_width - sizes[build_index], UINT32_MAX);
+		nodes[index] = flat;
+		return;
+	}
+
+	flat.axis = static_cast<uint8_t>(node.axis);
+	flat.offset = static_cast<uint32_t>(nodes.size());
+	nodes[index] = flat;
+	nodes.resize(nodes.size() + 2);
+
+	flatten(result, node.first, flat.offset, sizes, order);
+	flatten(result, node.second, flat.offset + 1, sizes, order);
+}
+
+void sphere_set::build()
+{
+	const size_t count = centers.size();
+	nodes.clear();
+	blocks.clear();
+	leaf_centers.clear();
+	leaf_radii.clear();
+	leaf_material_ids.clear();
+	if (count == 0)
+		return;
+
+	std::vector<bvh_primitive> prims(count);
+	concurrency::parallel_for(size_t(0), count, [&](size_t i)
+	{
+		const vec3 r(radii[i], radii[i], radii[i]);
+		prims[i].box = aabb(centers[i] - r, centers[i] + r);
+		prims[i].centroid = centers[i];
+		prims[i].index = static_cast<uint32_t>(i);
+	});
+
+	bvh_build_result result = build_bvh(std::move(prims));
+	box = result.nodes[0].box;
+
+	std::vector<uint32_t> sizes(result.nodes.size());
+	subtree_size(result, 0, sizes);
+
+	std::vector<uint32_t> order;
+	order.reserve(2 * count);
+	nodes.reserve(result.nodes.size() + 1);
+	nodes.resize(2);
+	flatten(result, 0, 0, sizes, order);
+	nodes[1] = nodes[0];
+
+	// Spheres in leaf order, padding slots get radius 0 and are never reported (prim_count masks them)
+	leaf_centers.resize(order.size());
+	leaf_radii.resize(order.size(), 0);
+	leaf_material_ids.resize(order.size(), 0);
+	blocks.resize(order.size() / sphere_block_width);
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		sphere_block& block = blocks[i / sphere_block_width];
+		const size_t lane = i % sphere_block_width;
+		const bool used = order[i] != UINT32_MAX;
+		if (used)
+		{
+			leaf_centers[i] = centers[order[i]];
+			leaf_radii[i] = radii[order[i]];
+			leaf_material_ids[i] = material_ids[order[i]];
+		}
+
+		double extent = leaf_radii[i];
+		for (int a = 0; a < 3; ++a)
+		{
+			block.center[a][lane] = static_cast<float>(leaf_centers[i][a]);
+			extent += std::abs(leaf_centers[i][a]);
+		}
+		block.radius[lane] = round_up(leaf_radii[i]);
+		block.extent[lane] = round_up(extent);
+	}
+}
+
+bool sphere_set::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	if (nodes.empty())
+		return false;
+
+	const sphere_block_ray sr = make_sphere_block_ray(r);
+	const float tmin = round_down(t_min);
+
+	return traverse_linear_bvh(nodes.data(), r, t_min, t_max, [&](uint32_t block, uint32_t count, double& closest)
+	{
+		const int mask = sphere_block_hit_simd(blocks[block], sr, tmin, round_up(closest));
+		bool hit_leaf = false;
+		for (uint32_t lane = 0; lane < count; ++lane)
+		{
+			if (!(mask & (1 << lane)))
+				continue;
+
+			const size_t i = static_cast<size_t>(block) * sphere_block_width + lane;
+			double t;
+			if (sphere_root(leaf_centers[i], leaf_radii[i], r, t_min, closest, t))
+			{
+				closest = t;
+				candidate.t = t;
+				candidate.object = this;
+				candidate.index = static_cast<uint32_t>(i);
+				hit_leaf = true;
+			}
+		}
+		return hit_leaf;
+	});
+}
+
+// Same record as sphere::hit, only for the closest sphere
+void sphere_set::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+	const uint32_t i = candidate.index;
+	sphere_surface(r, candidate.t, leaf_centers[i], leaf_radii[i], materials[leaf_material_ids[i]], rec);
+}
+
+bool sphere_set::occluded(const ray& r, double t_min, double t_max) const
+{
+	if (nodes.empty())
+		return false;
+
+	const sphere_block_ray sr = make_sphere_block_ray(r);
+	const float tmin = round_down(t_min);
+	const float tmax = round_up(t_max);
+
+	return occluded_linear_bvh(nodes.data(), r, t_min, t_max, [&](uint32_t block, uint32_t count)
+	{
+		const int mask = sphere_block_hit_simd(blocks[block], sr, tmin, tmax);
+		for (uint32_t lane = 0; lane < count; ++lane)
+		{
+			const size_t i = static_cast<size_t>(block) * sphere_block_width + lane;
+			double t;
+			if ((mask & (1 << lane)) && sphere_root(leaf_centers[i], leaf_radii[i], r, t_min, t_max, t))
+				return true;
+		}
+		return false;
+	});
+}
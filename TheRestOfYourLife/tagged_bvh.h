@@ -0,0 +1,314 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "quad.h"
+#include "aarect.h"
+#include "box.h"
+#include "constant_medium.h"
+#include "bvh_builder.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+
+// Primitive types tagged_bvh stores by value. Everything else is custom and called through hittable.
+enum class primitive_type : uint32_t
+{
+	sphere,
+	moving_sphere,
+	quad,
+	box,
+	medium,
+	custom
+};
+
+// Leaf entry of a tagged_bvh: the type and the index into the array of that type
+struct tagged_primitive
+{
+	primitive_type type;
+	uint32_t index;
+};
+
+
+/* Flattened BVH like linear_bvh, but the primitives of the built-in types are copied into one array
+   per type and the leaves reference them by type and index. Tests are dispatched with a switch on
+   the type and qualified calls (sphere::intersect, ...), which are bound statically and can be
+   inlined, instead of a virtual call through a shared_ptr per primitive. Objects of other types
+   (instances, meshes, user defined hittables) stay behind the virtual hittable interface.
+   The copies are taken when the tree is built: changes to the original objects afterwards need a
+   rebuild. refit() follows custom objects that moved and what the copies share, e.g. the boundary
+   of a medium. */
+class tagged_bvh : public hittable
+{
+	public:
+		tagged_bvh(hittable_list& list, double time0, double time1, const bvh_build_options& options = bvh_build_options());
+
+		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, tmin, tmax, rec);
+		}
+
+		virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+		virtual bool occluded(const ray& r, double tmin, double tmax) const;
+
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = bounds;
+			return !nodes.empty();
+		}
+
+		// Recomputes the leaf boxes from the copies and custom objects, then all parents
+		virtual void refit(double time0, double time1);
+
+		// Bytes of the nodes, leaf entries and primitive copies, without what custom objects point to
+		size_t memory_bytes() const
+		{
+			return nodes.size() * sizeof(linear_bvh_node) + primitives.size() * sizeof(tagged_primitive)
+				+ spheres.size() * sizeof(sphere) + moving_spheres.size() * sizeof(moving_sphere)
+				+ quads.size() * sizeof(quad) + boxes.size() * sizeof(box)
+				+ media.size() * sizeof(constant_medium) + custom.size() * sizeof(shared_ptr<hittable>);
+		}
+
+	public:
+		linear_bvh_nodes nodes;
+		std::vector<tagged_primitive> primitives;	// leaf order
+		std::vector<sphere> spheres;
+		std::vector<moving_sphere> moving_spheres;
+		std::vector<quad> quads;
+		std::vector<box> boxes;
+		std::vector<constant_medium> media;
+		std::vector<shared_ptr<hittable>> custom;
+		aabb bounds;
+
+	private:
+		// Copies object into the array of its type
+		tagged_primitive store(const shared_ptr<hittable>& object);
+
+		bool intersect_primitive(tagged_primitive prim, const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+		bool occluded_primitive(tagged_primitive prim, const ray& r, double tmin, double tmax) const;
+		bool primitive_box(tagged_primitive prim, double time0, double time1, aabb& output_box) const;
+
+		void flatten(const bvh_build_result& result, uint32_t build_index, size_t index, const std::vector<tagged_primitive>& stored);
+};
+
+tagged_bvh::tagged_bvh(hittable_list& list, double time0, double time1, const bvh_build_options& options)
+{
+	if (list.objects.empty())
+		return;
+
+	std::vector<tagged_primitive> stored;
+	stored.reserve(list.objects.size());
+	for (const auto& object : list.objects)
+		stored.push_back(store(object));
+
+	bvh_build_result result = build_bvh(make_bvh_primitives(list.objects, 0, list.objects.size(), time0, time1), options);
+	bounds = result.nodes[0].box;
+	nodes.reserve(result.nodes.size() + 1);
+	primitives.reserve(result.primitives.size());
+	nodes.resize(2);
+	flatten(result, 0, 0, stored);
+	nodes[1] = nodes[0];
+}
+
+// Exact types only, a subclass may override the tests. The rects add nothing but constructors to
+// quad, so they are stored as quads.
+tagged_primitive tagged_bvh::store(const shared_ptr<hittable>& object)
+{
+	const std::type_info& type = typeid(*object);
+	if (type == typeid(sphere))
+	{
+		spheres.push_back(static_cast<const sphere&>(*object));
+		return { primitive_type::sphere, static_cast<uint32_t>(spheres.size() - 1) };
+	}
+	if (type == typeid(moving_sphere))
+	{
+		moving_spheres.push_back(static_cast<const moving_sphere&>(*object));
+		return { primitive_type::moving_sphere, static_cast<uint32_t>(moving_spheres.size() - 1) };
+	}
+	if (type == typeid(quad) || type == typeid(xy_rect) || type == typeid(xz_rect) || type == typeid(yz_rect))
+	{
+		quads.push_back(static_cast<const quad&>(*object));
+		return { primitive_type::quad, static_cast<uint32_t>(quads.size() - 1) };
+	}
+	if (type == typeid(box))
+	{
+		boxes.push_back(static_cast<const box&>(*object));
+		return { primitive_type::box, static_cast<uint32_t>(boxes.size() - 1) };
+	}
+	if (type == typeid(constant_medium))
+	{
+		media.push_back(static_cast<const constant_medium&>(*object));
+		return { primitive_type::medium, static_cast<uint32_t>(media.size() - 1) };
+	}
+
+	custom.push_back(object);
+	return { primitive_type::custom, static_cast<uint32_t>(custom.size() - 1) };
+}
+
+// Same layout as linear_bvh: sibling pairs, nodes[1] repeats the root
+void tagged_bvh::flatten(const bvh_build_result& result, uint32_t build_index, size_t index, const std::vector<tagged_primitive>& stored)
+{
+	const bvh_build_node& node = result.nodes[build_index];
+	linear_bvh_node flat = {};
+	set_node_bounds(flat, node.box);
+
+	if (node.count > 0)
+	{
+		flat.offset = static_cast<uint32_t>(primitives.size());
+		flat.prim_count = static_cast<uint16_t>(node.count);
+		for (uint32_t i = node.first; i < node.first + node.count; ++i)
+			primitives.push_back(stored[result.primitives[i].index]);
+		nodes[index] = flat;
+		return;
+	}
+
+	flat.axis = static_cast<uint8_t>(node.axis);
+	flat.offset = static_cast<uint32_t>(nodes.size());
+	nodes[index] = flat;
+	nodes.resize(nodes.size() + 2);
+
+	flatten(result, node.first, flat.offset, stored);
+	flatten(result, node.second, flat.offset + 1, stored);
+}
+
+// The candidate points at the stored copy, whose surface_interaction() fills the record as the
+// original object would
+bool tagged_bvh::intersect_primitive(tagged_primitive prim, const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const
+{
+	switch (prim.type)
+	{
+		case primitive_type::sphere:
+			return spheres[prim.index].sphere::intersect(r, tmin, tmax, candidate, rec);
+		case primitive_type::moving_sphere:
+			return moving_spheres[prim.index].moving_sphere::intersect(r, tmin, tmax, candidate, rec);
+		case primitive_type::quad:
+			return quads[prim.index].quad::intersect(r, tmin, tmax, candidate, rec);
+		case primitive_type::box:
+			return boxes[prim.index].box::intersect(r, tmin, tmax, candidate, rec);
+		case primitive_type::medium:
+			return media[prim.index].constant_medium::intersect(r, tmin, tmax, candidate, rec);
+		default:
+			return custom[prim.index]->intersect(r, tmin, tmax, candidate, rec);
+	}
+}
+
+bool tagged_bvh::occluded_primitive(tagged_primitive prim, const ray& r, double tmin, double tmax) const
+{
+	switch (prim.type)
+	{
+		case primitive_type::sphere:
+			return spheres[prim.index].sphere::occluded(r, tmin, tmax);
+		case primitive_type::moving_sphere:
+			return moving_spheres[prim.index].moving_sphere::occluded(r, tmin, tmax);
+		case primitive_type::quad:
+			return quads[prim.index].quad::occluded(r, tmin, tmax);
+		case primitive_type::box:
+			return boxes[prim.index].box::occluded(r, tmin, tmax);
+		case primitive_type::medium:
+			return media[prim.index].constant_medium::occluded(r, tmin, tmax);
+		default:
+			return custom[prim.index]->occluded(r, tmin, tmax);
+	}
+}
+
+bool tagged_bvh::intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const
+{
+	if (nodes.empty())
+		return false;
+
+	return traverse_linear_bvh(nodes.data(), r, tmin, tmax, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		bool hit_anything = false;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			if (intersect_primitive(primitives[i], r, tmin, closest, candidate, rec))
+			{
+				hit_anything = true;
+				closest = candidate.t;
+			}
+		}
+		return hit_anything;
+	});
+}
+
+bool tagged_bvh::occluded(const ray& r, double tmin, double tmax) const
+{
+	if (nodes.empty())
+		return false;
+
+	return occluded_linear_bvh(nodes.data(), r, tmin, tmax, [&](uint32_t first, uint32_t count)
+	{
+		for (uint32_t i = first; i < first + count; ++i)
+			if (occluded_primitive(primitives[i], r, tmin, tmax))
+				return true;
+		return false;
+	});
+}
+
+bool tagged_bvh::primitive_box(tagged_primitive prim, double time0, double time1, aabb& output_box) const
+{
+	switch (prim.type)
+	{
+		case primitive_type::sphere:
+			return spheres[prim.index].sphere::bounding_box(time0, time1, output_box);
+		case primitive_type::moving_sphere:
+			return moving_spheres[prim.index].moving_sphere::bounding_box(time0, time1, output_box);
+		case primitive_type::quad:
+			return quads[prim.index].quad::bounding_box(time0, time1, output_box);
+		case primitive_type::box:
+			return boxes[prim.index].box::bounding_box(time0, time1, output_box);
+		case primitive_type::medium:
+			return media[prim.index].constant_medium::bounding_box(time0, time1, output_box);
+		default:
+			return custom[prim.index]->bounding_box(time0, time1, output_box);
+	}
+}
+
+void tagged_bvh::refit(double time0, double time1)
+{
+	if (nodes.empty())
+		return;
+
+	for (auto& medium : media)
+		medium.refit(time0, time1);
+	refit_objects(custom, time0, time1);
+
+	// Children always have higher indices than their parent
+	for (size_t i = nodes.size(); i-- > 0;)
+	{
+		linear_bvh_node& node = nodes[i];
+		if (node.prim_count > 0)
+		{
+			aabb leaf_box;
+			for (uint32_t p = node.offset; p < node.offset + node.prim_count; ++p)
+			{
+				aabb prim_box;
+				if (!primitive_box(primitives[p], time0, time1, prim_box))
+					std::cerr << "No bounding box in tagged_bvh::refit.\n";
+				if (p == node.offset)
+					leaf_box = prim_box;
+				else
+					leaf_box.expand(prim_box);
+			}
+			set_node_bounds(node, leaf_box);
+			continue;
+		}
+
+		const linear_bvh_node& first = nodes[node.offset];
+		const linear_bvh_node& second = nodes[node.offset + 1];
+		for (int a = 0; a < 3; ++a)
+		{
+			node.bounds_min[a] = std::min(first.bounds_min[a], second.bounds_min[a]);
+			node.bounds_max[a] = std::max(first.bounds_max[a], second.bounds_max[a]);
+		}
+	}
+
+	bounds = aabb(vec3(nodes[0].bounds_min[0], nodes[0].bounds_min[1], nodes[0].bounds_min[2]),
+		vec3(nodes[0].bounds_max[0], nodes[0].bounds_max[1], nodes[0].bounds_max[2]));
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "hittable.h"
+
+
+/* Affine transform p' = M * p + t as a 3x4 matrix, stored together with its inverse.
+   Transforms are only created from simple factors whose inverse is known (translation, rotation,
+   scaling) and by composing them, so the inverse never has to be computed numerically. */
+class affine_transform
+{
+	public:
+		// Identity
+		affine_transform();
+
+		static affine_transform translation(const vec3& offset);
+
+		// Same rotation as rotate_y: x' = cos * x + sin * z, z' = -sin * x + cos * z
+		static affine_transform rotation_y(const y_rotation& rotation);
+		static affine_transform rotation_y(double angle)
+		{
+			return rotation_y(y_rotation{ sin(degrees_to_radians(angle)), cos(degrees_to_radians(angle)) });
+		}
+
+		// Rotation by angle degrees around an arbitrary axis through the origin (right handed)
+		static affine_transform rotation(const vec3& axis, double angle);
+
+		// Scaling along the coordinate axes, factors may differ per axis and be negative but not zero
+		static affine_transform scaling(const vec3& factors);
+
+		// Applies other first, then this transform. translation(t) * rotation_y(r) is the same as
+		// translate(rotate_y(object, r), t).
+		affine_transform operator*(const affine_transform& other) const;
+
+		affine_transform inverse() const;
+
+		vec3 point(const vec3& p) const;
+		vec3 vector(const vec3& v) const;
+		// Normals are transformed with the inverse transpose and are not normalized
+		vec3 normal(const vec3& n) const;
+
+		vec3 inverse_point(const vec3& p) const;
+		vec3 inverse_vector(const vec3& v) const;
+
+		// Box around the transformed box, without transforming all 8 corners (Arvo's method)
+		aabb transform_box(const aabb& box) const;
+
+	private:
+		static vec3 apply(const double m[3][4], const vec3& v, double w);
+		static void multiply(const double a[3][4], const double b[3][4], double out[3][4]);
+
+	private:
+		double m[3][4];
+		double inv[3][4];
+};
+
+affine_transform::affine_transform()
+{
+	for (int i = 0; i < 3; ++i)
+		for (int j = 0; j < 4; ++j)
+			m[i][j] = inv[i][j] = (i == j) ? 1.0 : 0.0;
+}
+
+affine_transform affine_transform::translation(const vec3& offset)
+{
+	affine_transform t;
+	for (int i = 0; i < 3; ++i)
+	{
+		t.m[i][3] = offset[i];
+		t.inv[i][3] = -offset[i];
+	}
+	return t;
+}
+
+affine_transform affine_transform::rotation_y(const y_rotation& rotation)
+{
+	affine_transform t;
+	t.m[0][0] = rotation.cos_theta;
+	t.m[0][2] = rotation.sin_theta;
+	t.m[2][0] = -rotation.sin_theta;
+	t.m[2][2] = rotation.cos_theta;
+
+	// Rotations are orthogonal: inverse = transpose
+	for (int i = 0; i < 3; ++i)
+		for (int j = 0; j < 3; ++j)
+			t.inv[i][j] = t.m[j][i];
+	return t;
+}
+
+// Rodrigues' rotation formula as a matrix: M = cos * I + sin * [a]x + (1 - cos) * a * a^T
+affine_transform affine_transform::rotation(const vec3& axis, double angle)
+{
+	const vec3 a = unit_vector(axis);
+	const double s = sin(degrees_to_radians(angle));
+	const double c = cos(degrees_to_radians(angle));
+	const double k = 1 - c;
+
+	affine_transform t;
+	t.m[0][0] = c + k * a.x() * a.x();
+	t.m[0][1] = k * a.x() * a.y() - s * a.z();
+	t.m[0][2] = k * a.x() * a.z() + s * a.y();
+	t.m[1][0] = k * a.y() * a.x() + s * a.z();
+	t.m[1][1] = c + k * a.y() * a.y();
+	t.m[1][2] = k * a.y() * a.z() - s * a.x();
+	t.m[2][0] = k * a.z() * a.x() - s * a.y();
+	t.m[2][1] = k * a.z() * a.y() + s * a.x();
+	t.m[2][2] = c + k * a.z() * a.z();
+
+	for (int i = 0; i < 3; ++i)
+		for (int j = 0; j < 3; ++j)
+			t.inv[i][j] = t.m[j][i];
+	return t;
+}
+
+affine_transform affine_transform::scaling(const vec3& factors)
+{
+	affine_transform t;
+	for (int i = 0; i < 3; ++i)
+	{
+		if (factors[i] == 0)
+			std::cerr << "affine_transform::scaling with factor 0 has no inverse.\n";
+		t.m[i][i] = factors[i];
+		t.inv[i][i] = 1.0 / factors[i];
+	}
+	return t;
+}
+
+// out = a * b for 3x4 matrices with an implicit last row (0, 0, 0, 1)
+void affine_transform::multiply(const double a[3][4], const double b[3][4], double out[3][4])
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+		{
+			out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+			if (j == 3)
+				out[i][j] += a[i][3];
+		}
+	}
+}
+
+affine_transform affine_transform::operator*(const affine_transform& other) const
+{
+	affine_transform t;
+	multiply(m, other.m, t.m);
+	// (A * B)^-1 = B^-1 * A^-1
+	multiply(other.inv, inv, t.inv);
+	return t;
+}
+
+affine_transform affine_transform::inverse() const
+{
+	affine_transform t;
+	for (int i = 0; i < 3; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+		{
+			t.m[i][j] = inv[i][j];
+			t.inv[i][j] = m[i][j];
+		}
+	}
+	return t;
+}
+
+// w = 1 for points, w = 0 for vectors
+vec3 affine_transform::apply(const double m[3][4], const vec3& v, double w)
+{
+	return vec3(
+		m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z() + m[0][3] * w,
+		m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z() + m[1][3] * w,
+		m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z() + m[2][3] * w);
+}
+
+vec3 affine_transform::point(const vec3& p) const
+{
+	return apply(m, p, 1);
+}
+
+vec3 affine_transform::vector(const vec3& v) const
+{
+	return apply(m, v, 0);
+}
+
+vec3 affine_transform::normal(const vec3& n) const
+{
+	return vec3(
+		inv[0][0] * n.x() + inv[1][0] * n.y() + inv[2][0] * n.z(),
+		inv[0][1] * n.x() + inv[1][1] * n.y() + inv[2][1] * n.z(),
+		inv[0][2] * n.x() + inv[1][2] * n.y() + inv[2][2] * n.z());
+}
+
+vec3 affine_transform::inverse_point(const vec3& p) const
+{
+	return apply(inv, p, 1);
+}
+
+vec3 affine_transform::inverse_vector(const vec3& v) const
+{
+	return apply(inv, v, 0);
+}
+
+// Every output coordinate is a sum of terms m[i][j] * x_j, each term is smallest / largest at one
+// of the two box planes along j.
+aabb affine_transform::transform_box(const aabb& box) const
+{
+	vec3 min;
+	vec3 max;
+	for (int i = 0; i < 3; ++i)
+	{
+		min[i] = max[i] = m[i][3];
+		for (int j = 0; j < 3; ++j)
+		{
+			double a = m[i][j] * box.min()[j];
+			double b = m[i][j] * box.max()[j];
+			min[i] += std::min(a, b);
+			max[i] += std::max(a, b);
+		}
+	}
+	return aabb(min, max);
+}
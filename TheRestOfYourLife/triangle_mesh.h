@@ -0,0 +1,300 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "bvh_builder.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Triangles lying in an axis plane have flat boxes, which the slab test of the BVH misses at grazing
+// angles. Their boxes are made at least this thick, as for the axis aligned rects.
+const double triangle_box_padding = 0.0001;
+
+// Per ray setup of the watertight ray / triangle test (Woop, Benthin, Wald, "Watertight Ray/Triangle
+// Intersection"): the ray is made the z axis of a sheared coordinate system, done once per ray
+// instead of once per triangle.
+struct triangle_ray
+{
+	vec3 origin;
+	int kx;
+	int ky;
+	int kz;
+	double sx;
+	double sy;
+	double sz;
+};
+
+triangle_ray make_triangle_ray(const ray& r)
+{
+	triangle_ray tr;
+	tr.origin = r.origin();
+
+	const vec3 d = r.direction();
+	tr.kz = 0;
+	for (int a = 1; a < 3; ++a)
+		if (std::abs(d[a]) > std::abs(d[tr.kz])) tr.kz = a;
+	tr.kx = (tr.kz + 1) % 3;
+	tr.ky = (tr.kx + 1) % 3;
+
+	// Keeps the winding order, so the signs of the edge functions mean the same for every ray
+	if (d[tr.kz] < 0)
+		std::swap(tr.kx, tr.ky);
+
+	tr.sx = d[tr.kx] / d[tr.kz];
+	tr.sy = d[tr.ky] / d[tr.kz];
+	tr.sz = 1.0 / d[tr.kz];
+	return tr;
+}
+
+/* Watertight ray / triangle test. The edge functions of neighbouring triangles are computed from the
+   same shared vertices in the same way, so a ray hitting an edge exactly is counted by at least one
+   of the triangles: no rays slip through cracks between triangles of a closed mesh. Returns t and
+   the barycentric coordinates (b0, b1, b2) of the hit.
+   The sheared vertex coordinates are rounded to float, so the products in the edge functions are exact
+   in double and each edge function is one rounding of the exact difference. Both triangles at an edge
+   then get exactly opposite values, also where the compiler contracts the products into an FMA. */
+inline bool hit_triangle(const triangle_ray& tr, const vec3& a, const vec3& b, const vec3& c, double t_min, double t_max,
+	double& t, double& b0, double& b1, double& b2)
+{
+	const vec3 A = a - tr.origin;
+	const vec3 B = b - tr.origin;
+	const vec3 C = c - tr.origin;
+
+	const double ax = static_cast<float>(A[tr.kx] - tr.sx * A[tr.kz]);
+	const double ay = static_cast<float>(A[tr.ky] - tr.sy * A[tr.kz]);
+	const double bx = static_cast<float>(B[tr.kx] - tr.sx * B[tr.kz]);
+	const double by = static_cast<float>(B[tr.ky] - tr.sy * B[tr.kz]);
+	const double cx = static_cast<float>(C[tr.kx] - tr.sx * C[tr.kz]);
+	const double cy = static_cast<float>(C[tr.ky] - tr.sy * C[tr.kz]);
+
+	const double u = cx * by - cy * bx;
+	const double v = ax * cy - ay * cx;
+	const double w = bx * ay - by * ax;
+
+	if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+		return false;
+
+	const double det = u + v + w;
+	if (det == 0)
+		return false;
+
+	const double az = tr.sz * A[tr.kz];
+	const double bz = tr.sz * B[tr.kz];
+	const double cz = tr.sz * C[tr.kz];
+	t = (u * az + v * bz + w * cz) / det;
+	if (t <= t_min || t >= t_max)
+		return false;
+
+	b0 = u / det;
+	b1 = v / det;
+	b2 = w / det;
+	return true;
+}
+
+
+/* Indexed triangle mesh. Vertices are shared between triangles and stored as floats, the triangles
+   are indices into them plus a material id each. The mesh builds its own flattened BVH over the
+   triangles, so the scene BVH sees it as one object and traversal inside does not need a virtual
+   call per triangle. Triangles are reordered into the leaf order of the BVH.
+   uv are the barycentric coordinates of the hit, the normal is the geometric normal. */
+class triangle_mesh : public hittable
+{
+	public:
+		// positions: x, y, z per vertex, indices: 3 per triangle, material_ids: one per triangle
+		triangle_mesh(std::vector<float> positions, std::vector<uint32_t> indices, std::vector<uint32_t> material_ids,
+			std::vector<shared_ptr<material>> materials);
+
+		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, t_min, t_max, rec);
+		}
+
+		virtual bool intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const;
+		virtual void surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const;
+		virtual bool occluded(const ray& r, double t_min, double t_max) const;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = box;
+			return true;
+		}
+
+		size_t vertex_count() const { return vertex_positions.size() / 3; }
+		size_t triangle_count() const { return triangle_indices.size() / 3; }
+
+		// Bytes of vertices, triangles and BVH nodes
+		size_t memory_bytes() const
+		{
+			return vertex_positions.size() * sizeof(float) + triangle_indices.size() * sizeof(uint32_t)
+				+ triangle_materials.size() * sizeof(uint32_t) + nodes.size() * sizeof(linear_bvh_node);
+		}
+
+		vec3 vertex(uint32_t i) const
+		{
+			return vec3(vertex_positions[3 * i], vertex_positions[3 * i + 1], vertex_positions[3 * i + 2]);
+		}
+
+	public:
+		std::vector<float> vertex_positions;
+		std::vector<uint32_t> triangle_indices;
+		std::vector<uint32_t> triangle_materials;
+		std::vector<shared_ptr<material>> materials;
+		linear_bvh_nodes nodes;
+		aabb box;
+
+	private:
+		void flatten(const bvh_build_result& result, uint32_t build_index, size_t index,
+			const std::vector<uint32_t>& indices, const std::vector<uint32_t>& material_ids);
+};
+
+triangle_mesh::triangle_mesh(std::vector<float> positions, std::vector<uint32_t> indices, std::vector<uint32_t> material_ids,
+	std::vector<shared_ptr<material>> mesh_materials)
+	: vertex_positions(std::move(positions)), materials(std::move(mesh_materials))
+{
+	const size_t count = indices.size() / 3;
+	if (count == 0)
+	{
+		std::cerr << "triangle_mesh without triangles.\n";
+		return;
+	}
+
+	std::vector<bvh_primitive> prims(count);
+	concurrency::parallel_for(size_t(0), count, [&](size_t i)
+	{
+		const vec3 a = vertex(indices[3 * i]);
+		const vec3 b = vertex(indices[3 * i + 1]);
+		const vec3 c = vertex(indices[3 * i + 2]);
+
+		vec3 lo;
+		vec3 hi;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			lo[axis] = std::min({ a[axis], b[axis], c[axis] });
+			hi[axis] = std::max({ a[axis], b[axis], c[axis] });
+			if (hi[axis] - lo[axis] < 2 * triangle_box_padding)
+			{
+				lo[axis] -= triangle_box_padding;
+				hi[axis] += triangle_box_padding;
+			}
+		}
+
+		prims[i].box = aabb(lo, hi);
+		prims[i].centroid = prims[i].box.centroid();
+		prims[i].index = static_cast<uint32_t>(i);
+	});
+
+	bvh_build_result result = build_bvh(std::move(prims));
+	box = result.nodes[0].box;
+
+	triangle_indices.reserve(indices.size());
+	triangle_materials.reserve(count);
+	nodes.reserve(result.nodes.size() + 1);
+	nodes.resize(2);
+	flatten(result, 0, 0, indices, material_ids);
+	nodes[1] = nodes[0];
+}
+
+// Same layout as linear_bvh (sibling pairs, nodes[1] repeats the root). Leaves reference triangles,
+// which are appended in leaf order.
+void triangle_mesh::flatten(const bvh_build_result& result, uint32_t build_index, size_t index,
+	const std::vector<uint32_t>& indices, const std::vector<uint32_t>& material_ids)
+{
+	const bvh_build_node& node = result.nodes[build_index];
+	linear_bvh_node flat = {};
+	set_node_bounds(flat, node.box);
+
+	if (node.count > 0)
+	{
+		flat.offset = static_cast<uint32_t>(triangle_materials.size());
+		flat.prim_count = static_cast<uint16_t>(node.count);
+		for (uint32_t i = node.first; i < node.first + node.count; ++i)
+		{
+			const uint32_t tri = result.primitives[i].index;
+			triangle_indices.insert(triangle_indices.end(), indices.begin() + 3 * tri, indices.begin() + 3 * tri + 3);
+			triangle_materials.push_back(tri < material_ids.size() ? material_ids[tri] : 0);
+		}
+		nodes[index] = flat;
+		return;
+	}
+
+	flat.axis = static_cast<uint8_t>(node.axis);
+	flat.offset = static_cast<uint32_t>(nodes.size());
+	nodes[index] = flat;
+	nodes.resize(nodes.size() + 2);
+
+	flatten(result, node.first, flat.offset, indices, material_ids);
+	flatten(result, node.second, flat.offset + 1, indices, material_ids);
+}
+
+bool triangle_mesh::intersect(const ray& r, double t_min, double t_max, hit_candidate& candidate, hit_record& rec) const
+{
+	if (nodes.empty())
+		return false;
+
+	const triangle_ray tr = make_triangle_ray(r);
+	return traverse_linear_bvh(nodes.data(), r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		bool hit_leaf = false;
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			const uint32_t* tri = &triangle_indices[3 * i];
+			double t;
+			double b0;
+			double b1;
+			double b2;
+			if (hit_triangle(tr, vertex(tri[0]), vertex(tri[1]), vertex(tri[2]), t_min, closest, t, b0, b1, b2))
+			{
+				closest = t;
+				candidate.t = t;
+				candidate.object = this;
+				candidate.index = i;
+				candidate.u = b1;
+				candidate.v = b2;
+				hit_leaf = true;
+			}
+		}
+		return hit_leaf;
+	});
+}
+
+// The record is only filled once, for the closest triangle
+void triangle_mesh::surface_interaction(const ray& r, const hit_candidate& candidate, hit_record& rec) const
+{
+	const uint32_t* tri = &triangle_indices[3 * candidate.index];
+	const vec3 a = vertex(tri[0]);
+	const vec3 b = vertex(tri[1]);
+	const vec3 c = vertex(tri[2]);
+
+	// From the barycentrics, the point lies exactly on the triangle
+	rec.t = candidate.t;
+	rec.p = a + candidate.u * (b - a) + candidate.v * (c - a);
+	rec.u = candidate.u;
+	rec.v = candidate.v;
+	rec.set_face_normal(r, unit_vector(cross(b - a, c - a)));
+	const uint32_t material_id = triangle_materials[candidate.index];
+	rec.mat_ptr = material_id < materials.size() ? materials[material_id] : nullptr;
+}
+
+bool triangle_mesh::occluded(const ray& r, double t_min, double t_max) const
+{
+	if (nodes.empty())
+		return false;
+
+	const triangle_ray tr = make_triangle_ray(r);
+	return occluded_linear_bvh(nodes.data(), r, t_min, t_max, [&](uint32_t first, uint32_t count)
+	{
+		for (uint32_t i = first; i < first + count; ++i)
+		{
+			const uint32_t* tri = &triangle_indices[3 * i];
+			double t;
+			double b0;
+			double b1;
+			double b2;
+			if (hit_triangle(tr, vertex(tri[0]), vertex(tri[1]), vertex(tri[2]), t_min, t_max, t, b0, b1, b2))
+				return true;
+		}
+		return false;
+	});
+}
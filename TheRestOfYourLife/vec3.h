@@ -7,22 +7,22 @@ class vec3
 {
   public:
 
-    vec3() :e{ 0,0,0 } {}
+    constexpr vec3() :e{ 0,0,0 } {}
 
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    constexpr vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
-    double r() const { return e[0]; }
-    double g() const { return e[1]; }
-    double b() const { return e[2]; }
+    constexpr double x() const { return e[0]; }
+    constexpr double y() const { return e[1]; }
+    constexpr double z() const { return e[2]; }
+    constexpr double r() const { return e[0]; }
+    constexpr double g() const { return e[1]; }
+    constexpr double b() const { return e[2]; }
 
-    vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double &operator[](int i) { return e[i]; };
+    constexpr vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+    constexpr double operator[](int i) const { return e[i]; }
+    constexpr double &operator[](int i) { return e[i]; };
 
-    vec3& operator+=(const vec3& v)
+    constexpr vec3& operator+=(const vec3& v)
     {
         e[0] += v.e[0];
         e[1] += v.e[1];
@@ -30,7 +30,7 @@ class vec3
         return *this;
     }
 
-    vec3& operator*=(const double t)
+    constexpr vec3& operator*=(const double t)
     {
         e[0] *= t;
         e[1] *= t;
@@ -38,7 +38,7 @@ class vec3
         return *this;
     }
 
-    inline vec3& operator/=(const double t)
+    constexpr vec3& operator/=(const double t)
     {
         return *this *= 1/t;
     }
@@ -48,7 +48,7 @@ class vec3
         return sqrt(length_squared()); 
     }
 
-    double length_squared() const
+    constexpr double length_squared() const
     {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
@@ -95,47 +95,47 @@ inline std::ostream& operator<<(std::ostream& out, const vec3& v)
     return out << v.e[0] << " " << v.e[1] << " " << v.e[2];
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v)
+constexpr vec3 operator+(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v)
+constexpr vec3 operator-(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v)
+constexpr vec3 operator*(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator/(const vec3 &u, const vec3 &v)
+constexpr vec3 operator/(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[0] / v.e[0], u.e[1] / v.e[1], u.e[2] / v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3 &v)
+constexpr vec3 operator*(double t, const vec3 &v)
 {
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t)
+constexpr vec3 operator*(const vec3& v, double t)
 {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t)
+constexpr vec3 operator/(vec3 v, double t)
 {
     return (1/t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v)
+constexpr double dot(const vec3 &u, const vec3 &v)
 {
     return (u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2]);
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v)
+constexpr vec3 cross(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
@@ -147,6 +147,12 @@ inline vec3 unit_vector(vec3 v)
     return v / v.length();
 }
 
+// Same as unit_vector() but usable in constant expressions (slower, don't use it per ray).
+constexpr vec3 constexpr_unit_vector(vec3 v)
+{
+    return v / constexpr_sqrt(v.length_squared());
+}
+
 vec3 random_in_unit_disc()
 {
     while (true)
@@ -186,7 +192,7 @@ vec3 random_in_hemisphere(const vec3& normal)
 }
 
 // Standard reflection equation (incident angle = reflected angle etc.)
-vec3 reflect(const vec3& v, const vec3& n)
+constexpr vec3 reflect(const vec3& v, const vec3& n)
 {
     return v - 2 * dot(v, n) * n;
 }
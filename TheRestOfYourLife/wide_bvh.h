@@ -0,0 +1,484 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define WIDE_BVH_SSE 1
+	#include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+	#define WIDE_BVH_AVX 1
+	#include <immintrin.h>
+#endif
+
+
+/* Node of an N-wide BVH (N = 4: QBVH, N = 8: OBVH). The bounds of all children are stored as
+   structure of arrays (bounds_min[axis][child]), so one SIMD register holds the same coordinate of
+   all children and the slab test for every child runs at once. */
+template <int N>
+struct alignas(64) wide_bvh_node
+{
+	float bounds_min[3][N];
+	float bounds_max[3][N];
+	uint32_t child[N];			// interior child: node index, leaf child: first primitive
+	uint16_t prim_count[N];		// 0 for interior children
+	uint8_t child_count;		// number of used child slots
+};
+
+// Floats from the slab test are rounded, so the far distance is enlarged a bit to never miss a box
+// the double precision test would hit (conservative factor from pbrt, 1 + 2 * gamma(3)).
+const float wide_bvh_robust_scale = 1.0f + 2.0f * (3 * std::numeric_limits<float>::epsilon() * 0.5f)
+	/ (1 - 3 * std::numeric_limits<float>::epsilon() * 0.5f);
+
+// Ray in float precision with everything the slab test needs per node.
+struct wide_bvh_ray
+{
+	float origin[3];
+	float inv_dir[3];
+	int dir_is_neg[3];
+};
+
+// Returns a bit mask of the children hit by the ray and writes their entry distances into tnear.
+template <int N>
+inline int wide_node_hit(const wide_bvh_node<N>& node, const wide_bvh_ray& r, float tmin, float tmax, float tnear[N])
+{
+	float tfar[N];
+	for (int i = 0; i < N; ++i)
+	{
+		tnear[i] = tmin;
+		tfar[i] = tmax;
+	}
+
+	for (int a = 0; a < 3; ++a)
+	{
+		const float* near_plane = r.dir_is_neg[a] ? node.bounds_max[a] : node.bounds_min[a];
+		const float* far_plane = r.dir_is_neg[a] ? node.bounds_min[a] : node.bounds_max[a];
+		for (int i = 0; i < N; ++i)
+		{
+			float t0 = (near_plane[i] - r.origin[a]) * r.inv_dir[a];
+			float t1 = (far_plane[i] - r.origin[a]) * r.inv_dir[a];
+			tnear[i] = t0 > tnear[i] ? t0 : tnear[i];
+			tfar[i] = t1 < tfar[i] ? t1 : tfar[i];
+		}
+	}
+
+	int mask = 0;
+	for (int i = 0; i < node.child_count; ++i)
+		if (tnear[i] < tfar[i] * wide_bvh_robust_scale)
+			mask |= 1 << i;
+	return mask;
+}
+
+#ifdef WIDE_BVH_SSE
+// 4 children per SSE register. Operand order of max / min makes NaNs (0 * inf) keep the old value.
+inline int wide_node_hit(const wide_bvh_node<4>& node, const wide_bvh_ray& r, float tmin, float tmax, float tnear[4])
+{
+	__m128 tn = _mm_set1_ps(tmin);
+	__m128 tf = _mm_set1_ps(tmax);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		const __m128 o = _mm_set1_ps(r.origin[a]);
+		const __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+		const __m128 near_plane = _mm_load_ps(r.dir_is_neg[a] ? node.bounds_max[a] : node.bounds_min[a]);
+		const __m128 far_plane = _mm_load_ps(r.dir_is_neg[a] ? node.bounds_min[a] : node.bounds_max[a]);
+		tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, o), inv), tn);
+		tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv), tf);
+	}
+
+	_mm_storeu_ps(tnear, tn);
+	int mask = _mm_movemask_ps(_mm_cmplt_ps(tn, _mm_mul_ps(tf, _mm_set1_ps(wide_bvh_robust_scale))));
+	return mask & ((1 << node.child_count) - 1);
+}
+#endif
+
+#ifdef WIDE_BVH_AVX
+// 8 children per AVX register
+inline int wide_node_hit(const wide_bvh_node<8>& node, const wide_bvh_ray& r, float tmin, float tmax, float tnear[8])
+{
+	__m256 tn = _mm256_set1_ps(tmin);
+	__m256 tf = _mm256_set1_ps(tmax);
+
+	for (int a = 0; a < 3; ++a)
+	{
+		const __m256 o = _mm256_set1_ps(r.origin[a]);
+		const __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+		const __m256 near_plane = _mm256_load_ps(r.dir_is_neg[a] ? node.bounds_max[a] : node.bounds_min[a]);
+		const __m256 far_plane = _mm256_load_ps(r.dir_is_neg[a] ? node.bounds_min[a] : node.bounds_max[a]);
+		tn = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, o), inv), tn);
+		tf = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, o), inv), tf);
+	}
+
+	_mm256_storeu_ps(tnear, tn);
+	int mask = _mm256_movemask_ps(_mm256_cmp_ps(tn, _mm256_mul_ps(tf, _mm256_set1_ps(wide_bvh_robust_scale)), _CMP_LT_OQ));
+	return mask & ((1 << node.child_count) - 1);
+}
+#endif
+
+
+/* N-wide BVH built by collapsing the binary bvh_node tree: Starting with the two children of a
+   node, the interior child with the largest surface area is replaced by its own children until
+   N children are collected. Leaves keep the primitive ranges of the binary tree.
+   Traversal tests all children of a node at once and pushes the hit ones sorted by distance,
+   so the closest child is visited first. */
+template <int N>
+class wide_bvh : public hittable
+{
+	public:
+		wide_bvh(hittable_list& list, double time0, double time1)
+			: wide_bvh(make_shared<bvh_node>(list, time0, time1), time0, time1)
+		{}
+
+		wide_bvh(const shared_ptr<bvh_node>& root, double time0, double time1);
+
+		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+		{
+			return hit_deferred(*this, r, tmin, tmax, rec);
+		}
+
+		virtual bool intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const;
+		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+		{
+			output_box = box;
+			return true;
+		}
+
+		virtual bool occluded(const ray& r, double tmin, double tmax) const;
+
+		// Recomputes the child bounds of all nodes after primitives moved, children before parents
+		virtual void refit(double time0, double time1);
+
+		// Bytes of the nodes and primitive references, without the primitives themselves
+		size_t memory_bytes() const
+		{
+			return nodes.size() * sizeof(wide_bvh_node<N>) + primitives.size() * sizeof(shared_ptr<hittable>);
+		}
+
+	public:
+		std::vector<wide_bvh_node<N>> nodes;
+		std::vector<shared_ptr<hittable>> primitives;
+		aabb box;
+
+	private:
+		uint32_t collapse(const shared_ptr<bvh_node>& node, double time0, double time1, int depth);
+		void add_leaf(wide_bvh_node<N>& wide, int slot, const shared_ptr<hittable>& object);
+};
+
+using qbvh = wide_bvh<4>;
+using obvh = wide_bvh<8>;
+
+// True for bvh_nodes with two children, bvh_node leaves (no right child) count as primitives
+inline shared_ptr<bvh_node> interior_bvh_node(const shared_ptr<hittable>& object)
+{
+	auto node = std::dynamic_pointer_cast<bvh_node>(object);
+	return node && node->right ? node : nullptr;
+}
+
+template <int N>
+wide_bvh<N>::wide_bvh(const shared_ptr<bvh_node>& root, double time0, double time1)
+{
+	static_assert(N >= 2 && N <= 8, "wide_bvh supports 2 to 8 children per node");
+
+	box = root->box;
+	if (root->right)
+	{
+		collapse(root, time0, time1, 1);
+		return;
+	}
+
+	// The whole scene is a single leaf
+	wide_bvh_node<N> wide = {};
+	nodes.push_back(wide);
+	add_leaf(nodes[0], 0, root->left);
+	nodes[0].child_count = 1;
+}
+
+// Every wide node is at least one level of the binary tree, so trees from build_bvh() fit the
+// traversal stack. Deeper trees keep the interior bvh_nodes at the maximum depth as primitives.
+template <int N>
+uint32_t wide_bvh<N>::collapse(const shared_ptr<bvh_node>& node, double time0, double time1, int depth)
+{
+	std::vector<shared_ptr<hittable>> children = { node->left, node->right };
+
+	while (children.size() < N)
+	{
+		int largest = -1;
+		double largest_area = -1;
+		for (size_t i = 0; i < children.size(); ++i)
+		{
+			if (auto interior = interior_bvh_node(children[i]))
+			{
+				if (interior->box.surface_area() > largest_area)
+				{
+					largest_area = interior->box.surface_area();
+					largest = static_cast<int>(i);
+				}
+			}
+		}
+		if (largest < 0)
+			break;
+
+		auto expanded = interior_bvh_node(children[largest]);
+		children[largest] = expanded->left;
+		children.push_back(expanded->right);
+	}
+
+	uint32_t index = static_cast<uint32_t>(nodes.size());
+	nodes.push_back(wide_bvh_node<N>{});
+
+	for (int i = 0; i < N; ++i)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			nodes[index].bounds_min[a][i] = std::numeric_limits<float>::infinity();
+			nodes[index].bounds_max[a][i] = -std::numeric_limits<float>::infinity();
+		}
+	}
+	nodes[index].child_count = static_cast<uint8_t>(children.size());
+
+	for (size_t i = 0; i < children.size(); ++i)
+	{
+		aabb child_box;
+		if (!children[i]->bounding_box(time0, time1, child_box))
+			std::cerr << "No bounding box in wide_bvh constructor.\n";
+
+		for (int a = 0; a < 3; ++a)
+		{
+			nodes[index].bounds_min[a][i] = round_down(child_box.min()[a]);
+			nodes[index].bounds_max[a][i] = round_up(child_box.max()[a]);
+		}
+
+		auto interior = interior_bvh_node(children[i]);
+		if (interior && depth < linear_bvh_max_depth)
+		{
+			// nodes may reallocate during recursion, so only write through the index afterwards
+			uint32_t child_index = collapse(interior, time0, time1, depth + 1);
+			nodes[index].child[i] = child_index;
+			nodes[index].prim_count[i] = 0;
+		}
+		else
+		{
+			add_leaf(nodes[index], static_cast<int>(i), children[i]);
+		}
+	}
+
+	return index;
+}
+
+// Leaves of the binary tree are a single object or a bvh_node leaf holding a hittable_list
+template <int N>
+void wide_bvh<N>::add_leaf(wide_bvh_node<N>& wide, int slot, const shared_ptr<hittable>& object)
+{
+	shared_ptr<hittable> leaf = object;
+	auto node = std::dynamic_pointer_cast<bvh_node>(leaf);
+	if (node && !node->right)
+		leaf = node->left;
+
+	wide.child[slot] = static_cast<uint32_t>(primitives.size());
+
+	auto list = std::dynamic_pointer_cast<hittable_list>(leaf);
+	if (list && !list->objects.empty() && list->objects.size() <= UINT16_MAX)
+	{
+		for (const auto& prim : list->objects)
+			primitives.push_back(prim);
+		wide.prim_count[slot] = static_cast<uint16_t>(list->objects.size());
+	}
+	else
+	{
+		primitives.push_back(leaf);
+		wide.prim_count[slot] = 1;
+	}
+}
+
+template <int N>
+void wide_bvh<N>::refit(double time0, double time1)
+{
+	refit_objects(primitives, time0, time1);
+
+	// Child nodes are always created after their parent, so a backwards pass sees them first
+	for (size_t n = nodes.size(); n-- > 0;)
+	{
+		wide_bvh_node<N>& node = nodes[n];
+		for (int i = 0; i < node.child_count; ++i)
+		{
+			if (node.prim_count[i] > 0)
+			{
+				aabb leaf_box;
+				for (uint32_t p = node.child[i]; p < node.child[i] + node.prim_count[i]; ++p)
+				{
+					aabb prim_box;
+					if (!primitives[p]->bounding_box(time0, time1, prim_box))
+						std::cerr << "No bounding box in wide_bvh::refit.\n";
+					if (p == node.child[i])
+						leaf_box = prim_box;
+					else
+						leaf_box.expand(prim_box);
+				}
+
+				for (int a = 0; a < 3; ++a)
+				{
+					node.bounds_min[a][i] = round_down(leaf_box.min()[a]);
+					node.bounds_max[a][i] = round_up(leaf_box.max()[a]);
+				}
+				continue;
+			}
+
+			const wide_bvh_node<N>& child = nodes[node.child[i]];
+			for (int a = 0; a < 3; ++a)
+			{
+				float lo = std::numeric_limits<float>::infinity();
+				float hi = -std::numeric_limits<float>::infinity();
+				for (int c = 0; c < child.child_count; ++c)
+				{
+					lo = std::min(lo, child.bounds_min[a][c]);
+					hi = std::max(hi, child.bounds_max[a][c]);
+				}
+				node.bounds_min[a][i] = lo;
+				node.bounds_max[a][i] = hi;
+			}
+		}
+	}
+
+	if (!nodes.empty())
+	{
+		const wide_bvh_node<N>& root = nodes[0];
+		vec3 lo(infinity, infinity, infinity);
+		vec3 hi(-infinity, -infinity, -infinity);
+		for (int c = 0; c < root.child_count; ++c)
+		{
+			for (int a = 0; a < 3; ++a)
+			{
+				lo[a] = std::min(lo[a], static_cast<double>(root.bounds_min[a][c]));
+				hi[a] = std::max(hi[a], static_cast<double>(root.bounds_max[a][c]));
+			}
+		}
+		box = aabb(lo, hi);
+	}
+}
+
+template <int N>
+bool wide_bvh<N>::intersect(const ray& r, double tmin, double tmax, hit_candidate& candidate, hit_record& rec) const
+{
+	wide_bvh_ray wr;
+	for (int a = 0; a < 3; ++a)
+	{
+		wr.origin[a] = static_cast<float>(r.origin()[a]);
+		wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+		wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+	}
+
+	struct stack_entry
+	{
+		uint32_t index;
+		uint16_t prim_count;
+		float tnear;
+	};
+
+	stack_entry stack[linear_bvh_max_depth * (N - 1) + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0, -std::numeric_limits<float>::infinity() };
+
+	const float ftmin = round_down(tmin);
+	double closest = tmax;
+	bool hit_anything = false;
+
+	while (stack_size > 0)
+	{
+		const stack_entry entry = stack[--stack_size];
+		if (entry.tnear > closest)
+			continue;
+
+		if (entry.prim_count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + entry.prim_count; ++i)
+			{
+				if (primitives[i]->intersect(r, tmin, closest, candidate, rec))
+				{
+					hit_anything = true;
+					closest = candidate.t;
+				}
+			}
+			continue;
+		}
+
+		const wide_bvh_node<N>& node = nodes[entry.index];
+		float tnear[N];
+		int mask = wide_node_hit(node, wr, ftmin, round_up(closest), tnear);
+
+		// Sort the hit children far to near (insertion sort, at most N entries) and push them,
+		// so the nearest one ends up on top of the stack.
+		int first = stack_size;
+		for (int i = 0; i < N; ++i)
+		{
+			if (!(mask & (1 << i)))
+				continue;
+
+			stack_entry child = { node.child[i], node.prim_count[i], tnear[i] };
+			int j = stack_size++;
+			while (j > first && stack[j - 1].tnear < child.tnear)
+			{
+				stack[j] = stack[j - 1];
+				--j;
+			}
+			stack[j] = child;
+		}
+	}
+
+	return hit_anything;
+}
+
+// Any hit: children are pushed unsorted and the first blocking primitive ends the traversal
+template <int N>
+bool wide_bvh<N>::occluded(const ray& r, double tmin, double tmax) const
+{
+	wide_bvh_ray wr;
+	for (int a = 0; a < 3; ++a)
+	{
+		wr.origin[a] = static_cast<float>(r.origin()[a]);
+		wr.inv_dir[a] = static_cast<float>(1.0 / r.direction()[a]);
+		wr.dir_is_neg[a] = wr.inv_dir[a] < 0;
+	}
+
+	struct stack_entry
+	{
+		uint32_t index;
+		uint16_t prim_count;
+	};
+
+	stack_entry stack[linear_bvh_max_depth * (N - 1) + 1];
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0 };
+
+	const float ftmin = round_down(tmin);
+	const float ftmax = round_up(tmax);
+
+	while (stack_size > 0)
+	{
+		const stack_entry entry = stack[--stack_size];
+
+		if (entry.prim_count > 0)
+		{
+			for (uint32_t i = entry.index; i < entry.index + entry.prim_count; ++i)
+				if (primitives[i]->occluded(r, tmin, tmax))
+					return true;
+			continue;
+		}
+
+		const wide_bvh_node<N>& node = nodes[entry.index];
+		float tnear[N];
+		int mask = wide_node_hit(node, wr, ftmin, ftmax, tnear);
+		for (int i = 0; i < N; ++i)
+			if (mask & (1 << i))
+				stack[stack_size++] = { node.child[i], node.prim_count[i] };
+	}
+
+	return false;
+}